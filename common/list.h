@@ -67,6 +67,18 @@
         }                                                                       \
     } while(0)
 
+#define list_prepend(lst, elem, node)                                           \
+    do {                                                                        \
+        if(list_empty(lst)) {                                                   \
+            (lst)->tail = (lst)->head = elem;                                   \
+        } else {                                                                \
+            (lst)->head->node.prev = elem;                                      \
+            (elem)->node.next = (lst)->head;                                    \
+            (elem)->node.prev = NULL;                                           \
+            (lst)->head = elem;                                                 \
+        }                                                                       \
+    } while(0)
+
 #define list_empty(lst)                                                         \
     ((lst)->head == NULL)
 
@@ -1,5 +1,7 @@
 #include "locks.h"
 #include "registers.h"
+#include "util.h"
+#include <stddef.h>
 
 if_state_t disable_if()
 {
@@ -17,19 +19,91 @@ void restore_if(if_state_t state)
         cli();
 }
 
-bool spinlock_try_lock(spinlock_t* lock)
+void lock_stats_acquired(struct lock_stats* stats, uint64_t start, bool contended)
 {
-    uint32_t result = cmpxchg(&lock->l, 1, 0);
-    return result == 0;
+    uint64_t now = rdtsc();
+
+    stats->acquisitions++;
+    if(contended) {
+        stats->contended++;
+        stats->wait_cycles += now - start;
+    }
+    stats->locked_at = now;
 }
 
-bool spinlock_try_unlock(spinlock_t* lock)
+void lock_stats_released(struct lock_stats* stats)
+{
+    uint64_t held = rdtsc() - stats->locked_at;
+
+    stats->hold_cycles += held;
+    if(held > stats->max_hold_cycles)
+        stats->max_hold_cycles = held;
+}
+
+void spin_lock(spinlock_t* lock)
+{
+    spin_lock_poll(lock, NULL);
+}
+
+void spin_lock_poll(spinlock_t* lock, void (*poll)())
+{
+    uint64_t start = rdtsc();
+    uint16_t ticket = __sync_fetch_and_add(&lock->l, 1 << 16) >> 16;
+
+    bool contended = false;
+    while(lock->owner != ticket) {
+        contended = true;
+        if(poll)
+            poll();
+        asm volatile ( "pause" ::: "memory" );
+    }
+
+    lock_stats_acquired(&lock->stats, start, contended);
+}
+
+void spin_unlock(spinlock_t* lock)
+{
+    lock_stats_released(&lock->stats);
+
+    /* Only the holder writes owner */
+    asm volatile ( "" ::: "memory" );
+    lock->owner++;
+}
+
+if_state_t spin_lock_irqsave(spinlock_t* lock)
+{
+    if_state_t state = disable_if();
+    spin_lock(lock);
+    return state;
+}
+
+void spin_unlock_irqrestore(spinlock_t* lock, if_state_t state)
 {
-    uint32_t result = cmpxchg(&lock->l, 0, 1);
-    return result == 1;
+    spin_unlock(lock);
+    restore_if(state);
 }
 
+bool spinlock_try_lock(spinlock_t* lock)
+{
+    uint64_t start = rdtsc();
 
+    /* Free when the ticket being served is the next one, take it in the same step */
+    uint32_t l = lock->l;
+    uint16_t owner = l & 0xFFFF;
+    if(owner != (l >> 16))
+        return false;
+    if(cmpxchg(&lock->l, l + (1 << 16), l) != l)
+        return false;
 
+    lock_stats_acquired(&lock->stats, start, false);
+    return true;
+}
 
+bool spinlock_try_unlock(spinlock_t* lock)
+{
+    if(lock->owner == lock->next)
+        return false;
 
+    spin_unlock(lock);
+    return true;
+}
@@ -10,11 +10,28 @@ typedef uint32_t if_state_t;
 if_state_t disable_if();
 void restore_if(if_state_t state);
 
+#ifdef KERNEL
+/*
+ * Big kernel lock, recursive per cpu (see smp.h)
+ * Kernel critical sections also exclude the other cpus
+ */
+void kernel_lock();
+void kernel_unlock();
+
+#define enter_critical_section() \
+    if_state_t ifstate = disable_if(); \
+    kernel_lock()
+
+#define leave_critical_section() \
+    kernel_unlock(); \
+    restore_if(ifstate)
+#else
 #define enter_critical_section() \
     if_state_t ifstate = disable_if()
 
 #define leave_critical_section() \
     restore_if(ifstate)
+#endif
 
 /*
  * if `*dest` == `compare`:
@@ -26,24 +43,25 @@ void restore_if(if_state_t state);
 extern uint32_t cmpxchg(volatile uint32_t* dest, uint32_t exchange, uint32_t compare);
 
 
+/*
+ * Spinlocks
+ * spin_lock() waits for its turn, the _irqsave variants also keep
+ * interrupts off while the lock is held. Each lock counts its acquisitions,
+ * contention and hold time (see struct lock_stats)
+ */
+void spin_lock(spinlock_t* lock);
+void spin_lock_poll(spinlock_t* lock, void (*poll)());     /* Calls poll() while waiting */
+void spin_unlock(spinlock_t* lock);
+if_state_t spin_lock_irqsave(spinlock_t* lock);
+void spin_unlock_irqrestore(spinlock_t* lock, if_state_t state);
+
+/* Non-waiting variants, false if the lock was already taken (resp. not taken) */
 bool spinlock_try_lock(spinlock_t* lock);
 bool spinlock_try_unlock(spinlock_t* lock);
 
-#define checked_lock(lock) \
-    do { \
-        bool locked = spinlock_try_lock(lock); \
-        if(!locked) { \
-            panic("Concurrent modification detected on " #lock); \
-        } \
-    } while(0)
-
-#define checked_unlock(lock) \
-    do { \
-        bool locked = spinlock_try_unlock(lock); \
-        if(!locked) { \
-            panic("Concurrent modification detected on " #lock); \
-        } \
-    } while(0)
+/* Accounting shared by every kind of lock, start is rdtsc() before waiting */
+void lock_stats_acquired(struct lock_stats* stats, uint64_t start, bool contended);
+void lock_stats_released(struct lock_stats* stats);
 
 
 extern void cli();
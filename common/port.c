@@ -8,6 +8,7 @@
 uint32_t message_checksum(const struct message* msg)
 {
     unsigned checksum = hash2(&msg->sender, sizeof(msg->sender), 0);
+    checksum = hash2(&msg->timestamp, sizeof(msg->timestamp), checksum);
     checksum = hash2(&msg->reply_port, sizeof(msg->reply_port), checksum);
     checksum = hash2(&msg->code, sizeof(msg->code), checksum);
     checksum = hash2(&msg->len, sizeof(msg->len), checksum);
@@ -35,6 +36,7 @@ int msgsend(int port, struct message* msg)
 {
     memset(&msg->node, 0, sizeof(msg->node));
     msg->sender = 0;
+    msg->timestamp = 0;
 
     unsigned checksum = message_checksum(msg);
     msg->checksum = checksum;
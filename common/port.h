@@ -28,6 +28,7 @@ struct message {
     list_declare_node(message) node;
     uint32_t checksum;          /* Checksum (calculated by runtime library on send, verified by runtime library on receive) */
     int sender;                 /* Sending process pid, calculated by kernel */
+    uint64_t timestamp;         /* Send time in nanoseconds, set by kernel */
     int reply_port;             /* Port number to send response to */
     unsigned code;              /* Message code, interpretation depends on receiver */
     unsigned len;               /* Length of data[] (i.e. the header is not included) */
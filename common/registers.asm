@@ -1,5 +1,11 @@
 section .text
 
+; uint32_t read_cr4()
+global read_cr4
+read_cr4:
+    mov     eax, cr4
+    ret
+
 ; uint32_t read_cr3()
 global read_cr3
 read_cr3:
@@ -62,6 +68,16 @@ read_edi:
     mov     eax, edi
     ret
 
+; void write_cr4(uint32_t val)
+global write_cr4
+write_cr4:
+    push    ebp
+    mov     ebp, esp
+    mov     eax, [ebp + 8]
+    mov     cr4, eax
+    pop     ebp
+    ret
+
 ; void write_cr3(uint32_t val)
 global write_cr3
 write_cr3:
@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+extern uint32_t read_cr4();
 extern uint32_t read_cr3();
 extern uint32_t read_cr2();
 extern uint32_t read_cr1();
@@ -14,6 +15,7 @@ extern uint32_t read_esi();
 extern uint32_t read_edi();
 extern uint32_t read_esp();
 
+extern void write_cr4(uint32_t val);
 extern void write_cr3(uint32_t val);
 extern void write_cr2(uint32_t val);
 extern void write_cr1(uint32_t val);
@@ -22,6 +24,16 @@ extern void write_eflags(uint32_t val);
 
 #define barrier() asm volatile ("":::"memory")
 
+#define CPUID_FEATURES  1
+
+/* Feature flags (EDX) of cpuid leaf 1 */
+static inline uint32_t cpuid_features()
+{
+    uint32_t eax = CPUID_FEATURES, ebx, ecx, edx;
+    asm volatile ( "cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) );
+    return edx;
+}
+
 #define CR0_PG  (1 << 31)
 #define CR0_CD  (1 << 30)
 #define CR0_NW  (1 << 29)
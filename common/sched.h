@@ -0,0 +1,13 @@
+#pragma once
+
+/*
+ * Task priorities
+ * Lower values are more urgent. The scheduler always runs a task
+ * from the most urgent non-empty level, round-robin inside a level
+ */
+#define PRIORITY_LEVELS         32
+#define PRIORITY_HIGHEST        0
+#define PRIORITY_LOWEST         (PRIORITY_LEVELS - 1)
+
+#define PRIORITY_SERVER         8       /* Latency-sensitive servers (logger, vfs, blk) */
+#define PRIORITY_NORMAL         16      /* Default for new tasks */
@@ -2,9 +2,32 @@
 
 #include <stdint.h>
 
+/*
+ * Contention statistics of a lock, times in TSC cycles
+ */
+struct lock_stats {
+    const char* name;               /* NULL if never named */
+    uint32_t acquisitions;
+    uint32_t contended;             /* Acquisitions which had to wait */
+    uint64_t wait_cycles;
+    uint64_t hold_cycles;
+    uint64_t max_hold_cycles;
+    uint64_t locked_at;             /* rdtsc() when last taken */
+};
+
+/*
+ * Ticket spinlock: waiters are served in arrival order
+ * next is the ticket handed to the next locker, owner the one being served
+ */
 struct spinlock {
-    volatile uint32_t l;
+    union {
+        volatile uint32_t l;
+        struct {
+            volatile uint16_t owner;
+            volatile uint16_t next;
+        };
+    };
+    struct lock_stats stats;
 };
 typedef struct spinlock spinlock_t;
 #define SPINLOCK_INIT (struct spinlock) { .l = 0 }
-
@@ -18,6 +18,15 @@
 
 /* put current task into sleeping queue */
 #define SYSCALL_BLOCK           17
+#define SYSCALL_SETPRIORITY     18
+#define SYSCALL_CLOCK           19
+#define SYSCALL_SETSCHED        20
+#define SYSCALL_SPAWN           21
+#define SYSCALL_THREAD_CREATE   22
+#define SYSCALL_THREAD_EXIT     23
+#define SYSCALL_FUTEX_WAIT      24
+#define SYSCALL_FUTEX_WAKE      25
+#define SYSCALL_MPROTECT        26
 
 extern uint32_t syscall(uint32_t eax, uint32_t ebx,
                         uint32_t ecx, uint32_t edx,
@@ -1,10 +1,44 @@
 #pragma once
 
+#include <stdint.h>
+
 struct task_info {
     int pid;
+    int priority;
     char name[64];
 };
 
+/*
+ * Scheduler accounting of a task
+ * Times are in nanoseconds, spent in each state since the task was created
+ */
+struct sched_stats {
+    uint64_t run_ns;                /* Running on a cpu */
+    uint64_t ready_ns;              /* Runnable, waiting for a cpu */
+    uint64_t blocked_ns;            /* Waiting on a port, or for a message to be received */
+    uint64_t sleep_ns;              /* Sleeping until a deadline only */
+    uint32_t voluntary_switches;    /* Blocked, yielded or exited */
+    uint32_t involuntary_switches;  /* Preempted at the end of a quantum */
+    uint32_t wakeups;
+};
 
+/*
+ * Statistics of a kernel lock, times in nanoseconds
+ */
+struct lock_info {
+    char name[32];
+    uint32_t acquisitions;
+    uint32_t contended;             /* Acquisitions which had to wait */
+    uint64_t wait_ns;
+    uint64_t hold_ns;
+    uint64_t max_hold_ns;
+};
 
-
+struct task_stats {
+    int pid;
+    int priority;
+    int cpu;                        /* cpu it runs on, or ran on last */
+    char name[32];
+    uint64_t timestamp;             /* clock_ns() when the stats were taken */
+    struct sched_stats sched;
+};
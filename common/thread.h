@@ -0,0 +1,24 @@
+#pragma once
+
+/*
+ * User stacks of the threads of a process
+ *
+ * Slot n spans THREAD_STACK_STRIDE bytes below THREAD_STACKS_TOP - n * THREAD_STACK_STRIDE.
+ * A stack is populated on demand as it grows, down to the page at the bottom
+ * of its slot that is never mapped, to catch overflows.
+ * The runtime finds the slot of the running thread from its stack pointer,
+ * the kernel records it when the thread is created
+ */
+#define THREAD_STACKS_TOP       0xBFFFD000
+#define THREAD_STACK_STRIDE     (8 * 4096)
+#define MAX_THREADS             32
+
+#define THREAD_STACK_TOP(slot)  (THREAD_STACKS_TOP - (slot) * THREAD_STACK_STRIDE)
+#define THREAD_SLOT(esp)        ((THREAD_STACKS_TOP - 1 - (uint32_t)(esp)) / THREAD_STACK_STRIDE)
+
+#define FUTEX_WAIT_FOREVER      0xFFFFFFFF
+
+/* futex_wait() results */
+#define FUTEX_WOKEN             0
+#define FUTEX_AGAIN             (-1)    /* *addr did not hold the expected value */
+#define FUTEX_TIMEDOUT          (-2)
@@ -43,6 +43,14 @@ static inline uint64_t rdtsc()
     return ret;
 }
 
+/* Index of the least significant set bit. v must not be 0 */
+static inline unsigned bsf(uint32_t v)
+{
+    uint32_t ret;
+    asm ( "bsf %0, %1" : "=r"(ret) : "rm"(v) );
+    return ret;
+}
+
 unsigned hash2(const void* data, unsigned size, unsigned start_hash);
 unsigned hash(const void* data, unsigned size);
 
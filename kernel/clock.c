@@ -0,0 +1,122 @@
+#include "clock.h"
+#include "syscall_handler.h"
+#include "syscall.h"
+#include "io.h"
+#include "util.h"
+#include "debug.h"
+#include "kernel.h"
+#include "scheduler.h"
+
+#define PIT_COMMAND         0x43
+#define PIT_CHANNEL2        0x42
+#define PIT_CHANNEL2_ICW    0xB0            /* Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count) */
+#define PIT_GATE_PORT       0x61
+#define PIT_GATE            0x01            /* Channel 2 gate */
+#define PIT_SPEAKER         0x02            /* Channel 2 output to the speaker */
+#define PIT_OUT2            0x20            /* Channel 2 output pin */
+#define PIT_FREQ            1193180
+#define CALIBRATE_MS        10
+#define CALIBRATE_COUNT     (PIT_FREQ / (1000 / CALIBRATE_MS))
+
+static uint64_t tsc_boot = 0;
+static uint64_t tsc_hz = 0;
+static uint32_t mult = 0;
+static uint32_t shift = 0;
+
+/*
+ * Busy-wait CALIBRATE_COUNT PIT cycles on channel 2 and
+ * return the number of TSC cycles elapsed meanwhile
+ */
+static uint64_t calibrate_tsc()
+{
+    /* Gate low and speaker off, so the count does not start yet */
+    uint8_t gate = inb(PIT_GATE_PORT) & ~(PIT_SPEAKER|PIT_GATE);
+    outb(PIT_GATE_PORT, gate);
+
+    outb(PIT_COMMAND, PIT_CHANNEL2_ICW);
+    outb(PIT_CHANNEL2, LOBYTE(CALIBRATE_COUNT));
+    outb(PIT_CHANNEL2, HIBYTE(CALIBRATE_COUNT));
+
+    /* Raising the gate starts the count */
+    outb(PIT_GATE_PORT, gate | PIT_GATE);
+    uint64_t tsc0 = rdtsc();
+    while(!(inb(PIT_GATE_PORT) & PIT_OUT2));
+    uint64_t tsc1 = rdtsc();
+
+    outb(PIT_GATE_PORT, gate);
+    return tsc1 - tsc0;
+}
+
+/*
+ * Get current time in nanoseconds
+ * Params:
+ *  ebx     Pointer to uint64_t receiving the time
+ * Returns:
+ *  0       Success
+ *  -1      Invalid pointer
+ */
+static uint32_t syscall_clock_handler(struct isr_regs* regs)
+{
+    uint64_t now = clock_ns();
+    if(!task_copy_to_user((void*)regs->ebx, &now, sizeof(now)))
+        return (uint32_t)-1;
+
+    return 0;
+}
+
+void clock_init()
+{
+    /* Keep the fastest of a few runs, the slower ones were disturbed */
+    uint64_t cycles = calibrate_tsc();
+    for(int i = 0; i < 2; i++) {
+        uint64_t run = calibrate_tsc();
+        if(run < cycles)
+            cycles = run;
+    }
+
+    tsc_hz = cycles * PIT_FREQ / CALIBRATE_COUNT;
+    if(!tsc_hz)
+        panic("TSC calibration failed");
+
+    /* Most precise multiplier which still fits in 32 bits */
+    for(shift = 32; shift > 0; shift--) {
+        uint64_t m = (NSEC_PER_SEC << shift) / tsc_hz;
+        if(m <= 0xFFFFFFFF) {
+            mult = m;
+            break;
+        }
+    }
+    assert(mult);
+
+    tsc_boot = rdtsc();
+}
+
+void clock_syscall_init()
+{
+    syscall_register(SYSCALL_CLOCK, syscall_clock_handler);
+}
+
+uint64_t clock_ns()
+{
+    return clock_cycles_to_ns(rdtsc() - tsc_boot);
+}
+
+uint64_t clock_cycles_to_ns(uint64_t cycles)
+{
+    if(!mult)
+        return 0;
+
+    /* 64x32 bit multiply, split so that the product does not overflow */
+    uint32_t lo = cycles;
+    uint32_t hi = cycles >> 32;
+
+    uint64_t ns = ((uint64_t)lo * mult) >> shift;
+    if(hi)
+        ns += ((uint64_t)hi * mult) << (32 - shift);
+    return ns;
+}
+
+uint64_t clock_tsc_hz()
+{
+    return tsc_hz;
+}
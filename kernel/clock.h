@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Monotonic clocksource
+ *
+ * Nanoseconds since clock_init(), derived from the TSC.
+ * The TSC frequency is calibrated against PIT channel 2 at boot, cycles
+ * are converted with a fixed-point multiplier: ns = (cycles * mult) >> shift
+ */
+#define NSEC_PER_USEC       1000ULL
+#define NSEC_PER_MSEC       1000000ULL
+#define NSEC_PER_SEC        1000000000ULL
+
+void clock_init();
+void clock_syscall_init();        /* After syscall_init() */
+uint64_t clock_ns();
+uint64_t clock_cycles_to_ns(uint64_t cycles);
+uint64_t clock_tsc_hz();
@@ -5,68 +5,41 @@ section .text
 global switch_context
 switch_context:
     ;
-    ; params: context_t   ESP+4
+    ; params: context_t   ESP+4     prev, saved
+    ;         context_t   ESP+8     next, resumed
     ;
-
-    ; This function is not reentrant
-    ;xchg bx, bx
-    cli
-
-    ; save parameters in static space as we might switch esp
-    mov     edi, iret_data
-    mov     esi, [esp + 4]
-    mov     ecx, context_t_size
-    rep     movsb
-
-    ; switch pagedir
-    mov     eax, [iret_data + context_t.i_cr3]
-    mov     cr3, eax
-    
-    ; Segment regs
-    mov     eax, [iret_data + context_t.i_ds]
-    mov     ds, ax
-    mov     es, ax
-    mov     fs, ax
-    mov     gs, ax
-
-
-    ; iret stack layout
-    mov     eax, [iret_data + context_t.i_cs]
-    and     eax, 0x03
-    cmp     eax, 0x03
-    jne     .switch_stack
-
-    ; if we are switching into ring3, we need to push esp and ss
-    push    dword [iret_data + context_t.i_ss]
-    push    dword [iret_data + context_t.i_esp]
-    jmp     .continue_push
-
-.switch_stack:
-    ; Switch stack
-    mov     eax, [iret_data + context_t.i_ds]
-    mov     ss, eax
-    mov     esp, [iret_data + context_t.i_esp]
-
-.continue_push:
-    ; push the rest of iret regs
-    push    dword [iret_data + context_t.i_eflags]
-    push    dword [iret_data + context_t.i_cs]
-    push    dword [iret_data + context_t.i_eip]
-
-    ; set general-purpose registers
-    mov     edi, [iret_data + context_t.i_edi]
-    mov     esi, [iret_data + context_t.i_esi]
-    mov     edx, [iret_data + context_t.i_edx]
-    mov     ecx, [iret_data + context_t.i_ecx]
-    mov     ebx, [iret_data + context_t.i_ebx]
-    mov     eax, [iret_data + context_t.i_eax]
-    mov     ebp, [iret_data + context_t.i_ebp]
-    
-    ; perform iret
-    iret
-
-section .bss
-    iret_data: resb context_t_size
-
-
-
+    ; Kernel stacks live in the kernel heap, mapped in every pagedir:
+    ; the switch only swaps esp, registers the compiler expects to survive
+    ; the call are kept on the stack
+    ;
+    mov     eax, [esp + 4]
+    mov     edx, [esp + 8]
+
+    push    ebp
+    push    ebx
+    push    esi
+    push    edi
+
+    mov     [eax + context_t.c_esp], esp
+    mov     esp, [edx + context_t.c_esp]
+
+    ; switch pagedir, unless both tasks share it
+    mov     ecx, [edx + context_t.c_cr3]
+    mov     eax, cr3
+    cmp     eax, ecx
+    je      .restore
+    mov     cr3, ecx
+
+.restore:
+    pop     edi
+    pop     esi
+    pop     ebx
+    pop     ebp
+    ret
+
+extern task_started
+extern isr_return
+global task_start
+task_start:
+    call    task_started
+    jmp     isr_return
@@ -2,12 +2,25 @@
 
 #include <stdint.h>
 
+/*
+ * Saved state of a task which is switched out
+ * Everything else lives on the task's own kernel stack: the interrupt frame
+ * it entered the kernel with, down to the callee-saved registers pushed by
+ * switch_context()
+ */
 struct context {
-    uint32_t    cs, ds, ss;
     uint32_t    cr3;
-    uint32_t    esp, eflags, eip;
-    uint32_t    edi, esi, edx, ecx, ebx, eax, ebp;
+    uint32_t    esp;
 };
 
-extern void switch_context(struct context* context);
+/*
+ * Save the current kernel stack into prev and resume next on its own
+ * Returns when prev is switched back in
+ */
+extern void switch_context(struct context* prev, struct context* next);
 
+/*
+ * First instructions of a new task: resumed from switch_context() on a stack
+ * holding an interrupt frame, it leaves the kernel through that frame
+ */
+extern void task_start();
@@ -3,8 +3,9 @@
 #include "string.h"
 #include "vmm.h"
 #include "pmm.h"
+#include "util.h"
 
-elf_entry_t load_elf(const void* data, unsigned size)
+elf_entry_t load_elf(const void* data, unsigned size, struct vma_list* vmas)
 {
     const unsigned char* file_data = data;
 
@@ -43,26 +44,26 @@ elf_entry_t load_elf(const void* data, unsigned size)
 
             assert(segment_start >= (unsigned char*)USER_START);
             assert(segment_end <= (unsigned char*)USER_END);
+            assert(phdr->p_filesz <= phdr->p_memsz);
 
-            for(unsigned char* page = segment_start; page < segment_end; page += PAGE_SIZE) {
-                uint32_t frame = pmm_alloc();
-                assert(frame != INVALID_FRAME);
-
-                vmm_map(page,
-                        frame,
-                        VMM_PAGE_PRESENT | VMM_PAGE_WRITABLE);
-            }
-
-            bzero(segment_start, phdr->p_memsz);
+            /* Pages are whole, the head of the first one comes from the file as well */
+            uint32_t start = (uint32_t)segment_start & ~(PAGE_SIZE - 1);
+            uint32_t head = (uint32_t)segment_start - start;
+            const unsigned char* backing = NULL;
+            uint32_t backing_size = 0;
             if(phdr->p_filesz) {
-                memcpy(segment_start,
-                       file_data + phdr->p_offset,
-                       phdr->p_filesz);
+                assert(phdr->p_offset >= head);
+                backing = file_data + phdr->p_offset - head;
+                backing_size = phdr->p_filesz + head;
             }
 
-            for(unsigned char* page = segment_start; page < segment_end; page += PAGE_SIZE) {
-                vmm_remap(page, page_flags);
-            }
+            /* Nothing is mapped yet, pages are filled by the page fault handler */
+            vma_add(vmas,
+                    start,
+                    ALIGN((uint32_t)segment_end, PAGE_SIZE),
+                    page_flags,
+                    backing,
+                    backing_size);
         }
     }
     return ehdr->e_entry;
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include "vma.h"
 
 typedef void* Elf32_Addr;
 typedef uint16_t Elf32_Half;
@@ -164,6 +165,11 @@ typedef struct {
 #define PF_MASKPROC             0xf0000000
 
 typedef void (*elf_entry_t)(void);
-elf_entry_t load_elf(const void* data, unsigned size);
+
+/*
+ * Record the PT_LOAD segments of an image as regions of vmas, populated on demand
+ * data must stay mapped as long as the regions exist
+ */
+elf_entry_t load_elf(const void* data, unsigned size, struct vma_list* vmas);
 
 
@@ -0,0 +1,94 @@
+#include "fpu.h"
+#include "registers.h"
+#include "string.h"
+#include "debug.h"
+
+#define CPUID_EDX_FPU       (1 << 0)
+#define CPUID_EDX_FXSR      (1 << 24)
+#define CPUID_EDX_SSE       (1 << 25)
+
+#define FPU_DEFAULT_FCW     0x037F      /* All exceptions masked, extended precision */
+#define FPU_DEFAULT_FTW     0xFFFF      /* All registers empty (FNSAVE layout) */
+#define SSE_DEFAULT_MXCSR   0x1F80      /* All exceptions masked, round to nearest */
+
+/* Offsets into the save area */
+#define FXSAVE_FCW          0
+#define FXSAVE_MXCSR        24
+#define FNSAVE_FCW          0
+#define FNSAVE_FTW          8
+
+static bool fxsr = false;
+static bool sse = false;
+
+void fpu_init()
+{
+    uint32_t features = cpuid_features();
+    if(!(features & CPUID_EDX_FPU))
+        panic("No FPU");
+
+    fxsr = features & CPUID_EDX_FXSR;
+    sse = fxsr && (features & CPUID_EDX_SSE);
+
+    /* Native x87 error reporting, and let TS trap wait/fwait too */
+    uint32_t cr0 = read_cr0();
+    cr0 &= ~CR0_EM;
+    cr0 |= CR0_MP | CR0_NE;
+    write_cr0(cr0);
+
+    if(sse)
+        write_cr4(read_cr4() | CR4_PSFXSR | CR4_OSXMMEXCPT);
+
+    asm volatile ( "fninit" );
+
+    /* Nobody owns the registers yet */
+    fpu_trap(true);
+}
+
+void fpu_state_init(struct fpu_state* state)
+{
+    bzero(state, sizeof(struct fpu_state));
+
+    if(fxsr) {
+        /* An abridged tag word of 0 means every register is empty */
+        *(uint16_t*)(state->data + FXSAVE_FCW) = FPU_DEFAULT_FCW;
+        *(uint32_t*)(state->data + FXSAVE_MXCSR) = SSE_DEFAULT_MXCSR;
+    } else {
+        *(uint16_t*)(state->data + FNSAVE_FCW) = FPU_DEFAULT_FCW;
+        *(uint16_t*)(state->data + FNSAVE_FTW) = FPU_DEFAULT_FTW;
+    }
+}
+
+void fpu_save(struct fpu_state* state)
+{
+    assert(!fpu_trapping());
+
+    if(fxsr)
+        asm volatile ( "fxsave [%0]" :: "r"(state->data) : "memory" );
+    else
+        asm volatile ( "fnsave [%0]; fwait" :: "r"(state->data) : "memory" );
+}
+
+void fpu_restore(const struct fpu_state* state)
+{
+    assert(!fpu_trapping());
+
+    if(fxsr)
+        asm volatile ( "fxrstor [%0]" :: "r"(state->data) : "memory" );
+    else
+        asm volatile ( "frstor [%0]" :: "r"(state->data) : "memory" );
+}
+
+void fpu_trap(bool enable)
+{
+    uint32_t cr0 = read_cr0();
+
+    if(enable && !(cr0 & CR0_TS))
+        write_cr0(cr0 | CR0_TS);
+    else if(!enable && (cr0 & CR0_TS))
+        asm volatile ( "clts" );
+}
+
+bool fpu_trapping()
+{
+    return read_cr0() & CR0_TS;
+}
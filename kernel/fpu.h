@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * x87/SSE register file
+ *
+ * The kernel itself never uses the FPU (see the kernel Makefile), so the
+ * registers only ever hold task state. CR0.TS makes the first FPU
+ * instruction of a task trap (#NM), which is when the scheduler loads its
+ * state: tasks that never touch the FPU cost nothing on a switch.
+ *
+ * States are saved with FXSAVE when available, else with FNSAVE
+ */
+#define FPU_STATE_SIZE      512
+
+struct fpu_state {
+    uint8_t data[FPU_STATE_SIZE];
+} __attribute__((aligned(16)));
+
+void fpu_init();                    /* On every cpu: enable the FPU, and SSE if supported */
+
+/* Initial state for a task that never used the FPU */
+void fpu_state_init(struct fpu_state* state);
+
+void fpu_save(struct fpu_state* state);
+void fpu_restore(const struct fpu_state* state);
+
+/* CR0.TS: trap on the next FPU instruction */
+void fpu_trap(bool enable);
+bool fpu_trapping();
@@ -5,8 +5,10 @@
 #include "pmm.h"
 #include "kernel.h"
 #include "locks.h"
+#include "smp.h"
 
 #include <stdint.h>
+#include <stddef.h>
 
 #define GDT_ACCESSED        1
 #define GDT_WRITABLE        (1 << 1)
@@ -26,6 +28,9 @@
 #define GDT_GRAN1B          0
 #define GDT_GRAN4K         (1 << 7)
 
+/* Default I/O permissions only cover ports up to DEBUG_PORT, plus the 0xFF terminator */
+#define DEFAULT_IOMAP_SIZE  ((DEBUG_PORT / 8) + 2)
+
 struct tss_entry {
     uint16_t prev_tss;
     uint16_t reserved0;
@@ -66,6 +71,7 @@ struct tss_entry {
     uint16_t trap;
     uint16_t iomap_base;
     uint8_t iomap[IOMAP_SIZE];
+    uint8_t default_iomap[DEFAULT_IOMAP_SIZE];  /* Must stay last, see gdt.h */
 } __attribute__((packed));
 
 struct gdt_entry {
@@ -82,38 +88,61 @@ struct gdt_ptr {
    uint32_t base;               // The address of the first gdt_entry struct.
 } __attribute__((packed));
 
-static struct gdt_entry gdt_entries[6];
-static struct gdt_ptr   gdt_ptr;
-static struct tss_entry tss;
+/*
+ * One GDT and TSS per cpu
+ * The GDT base loaded in a cpu identifies it, see gdt_cpu()
+ */
+static struct gdt_entry gdt_entries[MAX_CPUS][6];
+static struct gdt_ptr   gdt_ptrs[MAX_CPUS];
+static struct tss_entry tss_entries[MAX_CPUS];
+
+/* What the full bitmap of each cpu's TSS holds */
+static struct {
+    uint32_t id;                        /* 0: the default permissions */
+    unsigned lo, hi;
+} loaded_iomaps[MAX_CPUS];
 
-static void set_descriptor(int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran);
+static uint32_t next_iomap_id = 1;
+
+static void set_descriptor(struct gdt_entry* entries, int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran);
 
 void gdt_init()
 {
-    gdt_ptr.limit = (sizeof(struct gdt_entry) * (sizeof(gdt_entries)/sizeof(*gdt_entries))) - 1;
-    gdt_ptr.base = (uint32_t)&gdt_entries;
+    gdt_init_cpu(BSP_CPU);
+}
+
+void gdt_init_cpu(int cpu)
+{
+    assert(cpu >= 0 && cpu < MAX_CPUS);
+
+    struct gdt_entry* entries = gdt_entries[cpu];
+    struct gdt_ptr* gdt_ptr = &gdt_ptrs[cpu];
+    struct tss_entry* tss = &tss_entries[cpu];
+
+    gdt_ptr->limit = sizeof(gdt_entries[cpu]) - 1;
+    gdt_ptr->base = (uint32_t)entries;
 
-    set_descriptor(0, 0x0, 0x0, 0x0, 0x0);  /* NULL descriptor */
+    set_descriptor(entries, 0, 0x0, 0x0, 0x0, 0x0);  /* NULL descriptor */
     set_descriptor(
-        1, 
+        entries, 1, 
         0x0, 0xFFFFFFFF, 
         GDT_READABLE|GDT_CODE|GDT_TYPE(1)|GDT_PRESENT,
         GDT_32BIT|GDT_GRAN4K
     );  /* Kernel code */
     set_descriptor(
-        2,
+        entries, 2,
         0x0, 0xFFFFFFFF,
         GDT_WRITABLE|GDT_TYPE(1)|GDT_PRESENT,
         GDT_32BIT|GDT_GRAN4K
     ); /* Kernel data */
     set_descriptor(
-        3,
+        entries, 3,
         0x0, 0xFFFFFFFF,
         GDT_READABLE|GDT_CODE|GDT_TYPE(1)|GDT_DPL(3)|GDT_PRESENT,
         GDT_32BIT|GDT_GRAN4K
     ); /* User code */
     set_descriptor(
-        4,
+        entries, 4,
         0x0, 0xFFFFFFFF,
         GDT_WRITABLE|GDT_TYPE(1)|GDT_DPL(3)|GDT_PRESENT,
         GDT_32BIT|GDT_GRAN4K
@@ -125,24 +154,31 @@ void gdt_init()
      * If a bit is set in the iomap, the corresponding port causes a GPF on access in ring3
      * iomap must be terminated by a 0xFF
      */
-    bzero(&tss, sizeof(tss));
-    tss.ss0 = KERNEL_DATA_SEG;
-    tss.esp0 = (uint32_t)(initial_kernel_stack + PAGE_SIZE);
-    tss.cs = KERNEL_CODE_SEG | 3;
-    tss.ss = tss.es = tss.ds = tss.fs = tss.gs = KERNEL_DATA_SEG | 3;
-    tss.iomap_base = tss.iomap - (uint8_t*)&tss;
-    memset(tss.iomap, 0xFF, sizeof(tss.iomap));
+    bzero(tss, sizeof(*tss));
+    tss->ss0 = KERNEL_DATA_SEG;
+    tss->esp0 = (uint32_t)(initial_kernel_stack + PAGE_SIZE);
+    tss->cs = KERNEL_CODE_SEG | 3;
+    tss->ss = tss->es = tss->ds = tss->fs = tss->gs = KERNEL_DATA_SEG | 3;
+    memset(tss->iomap, 0xFF, sizeof(tss->iomap));
+    memset(tss->default_iomap, 0xFF, sizeof(tss->default_iomap));
+    tss->iomap[DEBUG_PORT / 8] &= ~(1 << (DEBUG_PORT % 8));
+    tss->default_iomap[DEBUG_PORT / 8] &= ~(1 << (DEBUG_PORT % 8));
+    tss->iomap_base = offsetof(struct tss_entry, default_iomap);
+    loaded_iomaps[cpu].id = 0;
+    loaded_iomaps[cpu].lo = loaded_iomaps[cpu].hi = 0;
+
+    /* The limit is inclusive: ports past default_iomap must fall outside */
     set_descriptor(
-        5,
-        (uint32_t)&tss,
-        sizeof(tss),
+        entries, 5,
+        (uint32_t)tss,
+        sizeof(*tss) - 1,
         GDT_DPL(3)|GDT_CODE|GDT_ACCESSED|GDT_PRESENT,
         0
     ); /* TSS */
 
-    assert(sizeof(tss) >= 103);
+    assert(sizeof(*tss) >= 103);
 
-    gdt_flush(&gdt_ptr);
+    gdt_flush(gdt_ptr);
     tss_flush();
 
     /*
@@ -157,36 +193,122 @@ void gdt_init()
     write_eflags(eflags);
 }
 
-static void set_descriptor(int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran)
+static void set_descriptor(struct gdt_entry* entries, int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran)
+{
+    entries[num].base_low    = (base & 0xFFFF);
+    entries[num].base_middle = (base >> 16) & 0xFF;
+    entries[num].base_high   = (base >> 24) & 0xFF;
+
+    entries[num].limit_low   = (limit & 0xFFFF);
+    entries[num].granularity = (limit >> 16) & 0x0F;
+
+    entries[num].granularity |= gran & 0xF0;
+    entries[num].access      = access;
+}
+
+/*
+ * Index of the current cpu
+ * Before gdt_init() the bootloader GDT is loaded, which can only be the BSP
+ */
+int gdt_cpu()
+{
+    struct gdt_ptr current;
+    asm volatile ( "sgdt %0" : "=m"(current) );
+
+    uint32_t offset = current.base - (uint32_t)gdt_entries;
+    if(current.base < (uint32_t)gdt_entries || offset >= sizeof(gdt_entries))
+        return BSP_CPU;
+    return offset / sizeof(gdt_entries[0]);
+}
+
+void iomap_init(struct iomap* iomap)
+{
+    memset(iomap->bits, 0xFF, sizeof(iomap->bits));
+    iomap->bits[DEBUG_PORT / 8] &= ~(1 << (DEBUG_PORT % 8));
+    iomap->lo = iomap->hi = 0;
+    iomap->id = next_iomap_id++;
+}
+
+void iomap_allow(struct iomap* iomap, int port, bool allow)
 {
-    gdt_entries[num].base_low    = (base & 0xFFFF);
-    gdt_entries[num].base_middle = (base >> 16) & 0xFF;
-    gdt_entries[num].base_high   = (base >> 24) & 0xFF;
+    assert(port >= 0 && port < 65536);
+
+    unsigned idx = port / 8;
+    uint8_t mask = 1 << (port % 8);
+
+    if(allow)
+        iomap->bits[idx] &= ~mask;
+    else
+        iomap->bits[idx] |= mask;
+
+    if(iomap->lo == iomap->hi) {
+        iomap->lo = idx;
+        iomap->hi = idx + 1;
+    } else if(idx < iomap->lo) {
+        iomap->lo = idx;
+    } else if(idx >= iomap->hi) {
+        iomap->hi = idx + 1;
+    }
+    iomap->id = next_iomap_id++;
+}
 
-    gdt_entries[num].limit_low   = (limit & 0xFFFF);
-    gdt_entries[num].granularity = (limit >> 16) & 0x0F;
+bool iomap_test(const struct iomap* iomap, int port)
+{
+    assert(port >= 0 && port < 65536);
 
-    gdt_entries[num].granularity |= gran & 0xF0;
-    gdt_entries[num].access      = access;
+    if(!iomap)
+        return port != DEBUG_PORT;
+    return iomap->bits[port / 8] & (1 << (port % 8));
 }
 
-void gdt_iomap_set(void* buffer, size_t size)
+void gdt_iomap_load(const struct iomap* iomap)
 {
-    assert(size <= sizeof(tss.iomap));
-    memcpy(tss.iomap, buffer, size);
+    int cpu = gdt_cpu();
+    struct tss_entry* tss = &tss_entries[cpu];
+
+    if(!iomap) {
+        tss->iomap_base = offsetof(struct tss_entry, default_iomap);
+        return;
+    }
+
+    tss->iomap_base = offsetof(struct tss_entry, iomap);
+    if(loaded_iomaps[cpu].id == iomap->id)
+        return;
+
+    /*
+     * Outside of its range, each map holds the default permissions:
+     * copying the union of both ranges from the new one is enough
+     */
+    unsigned lo = iomap->lo, hi = iomap->hi;
+    if(loaded_iomaps[cpu].lo != loaded_iomaps[cpu].hi) {
+        if(lo == hi) {
+            lo = loaded_iomaps[cpu].lo;
+            hi = loaded_iomaps[cpu].hi;
+        } else {
+            if(loaded_iomaps[cpu].lo < lo)
+                lo = loaded_iomaps[cpu].lo;
+            if(loaded_iomaps[cpu].hi > hi)
+                hi = loaded_iomaps[cpu].hi;
+        }
+    }
+    memcpy(tss->iomap + lo, iomap->bits + lo, hi - lo);
+
+    loaded_iomaps[cpu].id = iomap->id;
+    loaded_iomaps[cpu].lo = iomap->lo;
+    loaded_iomaps[cpu].hi = iomap->hi;
 }
 
 void tss_set_kernel_stack(void* esp0)
 {
     enter_critical_section();
-    tss.esp0 = (uint32_t)esp0;
+    tss_entries[gdt_cpu()].esp0 = (uint32_t)esp0;
     leave_critical_section();
 }
 
 void* tss_get_kernel_stack()
 {
     enter_critical_section();
-    void* result = (void*)tss.esp;
+    void* result = (void*)tss_entries[gdt_cpu()].esp;
     leave_critical_section();
     return result;
 }
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 #define KERNEL_CODE_SEG     0x08
 #define KERNEL_DATA_SEG     0x10
@@ -12,10 +14,13 @@
 #define RPL1                0x1
 #define RPL2                0x2
 #define RPL3                0x3
-#define IOMAP_SIZE          ((65536 / 8) + 1)
+#define IOMAP_BYTES         (65536 / 8)
+#define IOMAP_SIZE          (IOMAP_BYTES + 1)
 
 void gdt_init();
+void gdt_init_cpu(int cpu);             /* Load a cpu's own GDT and TSS */
 void gdt_flush(void* gdtr);
+int gdt_cpu();
 
 void tss_flush();
 void tss_set_kernel_stack(void* esp0);
@@ -24,7 +29,24 @@ void* tss_get_kernel_stack();
 /*
  * The IOMAP controls usermode access to ports.
  * Set port to 0 to allow usermode to access it
- * By default, all ports are forbidden to usermode
+ * By default, all ports but DEBUG_PORT are forbidden to usermode
+ *
+ * Tasks with the default permissions share a tiny bitmap placed at the very
+ * end of the TSS: ports past it are beyond the TSS limit, and thus forbidden.
+ * Switching to them only changes iomap_base.
+ * The full bitmap of the TSS holds the last struct iomap loaded on that cpu,
+ * it is only rewritten over the range of bytes either map changed
  */
-void gdt_iomap_set(void* buffer, size_t size);
+struct iomap {
+    uint32_t id;                        /* Identifies the contents, renewed on every change */
+    unsigned lo, hi;                    /* Only bytes in [lo, hi) may differ from the default */
+    uint8_t bits[IOMAP_BYTES];
+};
+
+void iomap_init(struct iomap* iomap);   /* Default permissions */
+void iomap_allow(struct iomap* iomap, int port, bool allow);
+bool iomap_test(const struct iomap* iomap, int port);  /* iomap can be NULL for the default */
+
+/* Load iomap in the TSS of the current cpu, NULL for the default permissions */
+void gdt_iomap_load(const struct iomap* iomap);
 
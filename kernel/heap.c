@@ -161,23 +161,19 @@ static struct heap_block_header* heap_grow(struct heap* heap, unsigned size)
     unsigned char* end_of_heap = ((unsigned char*)last) + last->size;
     assert(IS_ALIGNED((uint32_t)end_of_heap, PAGE_SIZE));
 
-    for(unsigned char* page = end_of_heap; page < end_of_heap + size; page += PAGE_SIZE) {
-        if(heap->size >= heap->max_size)
-            break;
-
-        if(vmm_paging_enabled()) {
-            uint32_t frame = pmm_alloc();
-            if(frame == INVALID_FRAME)
-                break;
+    if(size > heap->max_size - heap->size)
+        size = TRUNCATE(heap->max_size - heap->size, PAGE_SIZE);
 
-            vmm_map(page, frame, VMM_PAGE_PRESENT | VMM_PAGE_WRITABLE);
-        } else if(pmm_initialized()) {
-            pmm_reserve((uint32_t)page - KERNEL_BASE_ADDR);
+    if(vmm_paging_enabled()) {
+        allocated = vmm_map_range(end_of_heap, size / PAGE_SIZE, VMM_PAGE_PRESENT | VMM_PAGE_WRITABLE) * PAGE_SIZE;
+    } else {
+        if(pmm_initialized()) {
+            for(unsigned char* page = end_of_heap; page < end_of_heap + size; page += PAGE_SIZE)
+                pmm_reserve((uint32_t)page - KERNEL_BASE_ADDR);
         }
-
-        heap->size += PAGE_SIZE;
-        allocated += PAGE_SIZE;
+        allocated = size;
     }
+    heap->size += allocated;
 
     if(allocated) {
         //trace("Heap grown by %d bytes", allocated);
@@ -76,19 +76,28 @@ isr_common_stub:
     mov     ax, ds              ; Lower 16-bits of eax = ds.
     push    eax                 ; save the data segment descriptor
 
+    cmp     ax, 0x10            ; interrupted in the kernel: segments are already loaded
+    je      .kernel_segments
     mov     ax, 0x10            ; load the kernel data segment descriptor
     mov     ds, ax
     mov     es, ax
     mov     fs, ax
     mov     gs, ax
+.kernel_segments:
 
     call    isr_handler
 
+; Also the way out of the kernel for new tasks, see task_start
+global isr_return
+isr_return:
     pop     eax                 ; reload the original data segment descriptor
+    cmp     ax, 0x10
+    je      .restored_segments
     mov     ds, ax
     mov     es, ax
     mov     fs, ax
     mov     gs, ax
+.restored_segments:
 
     popa                        ; Pops edi,esi,ebp...
     add     esp, 8              ; Cleans up the pushed error code and pushed ISR number
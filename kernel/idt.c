@@ -4,6 +4,10 @@
 #include "debug.h"
 #include "kernel.h"
 #include "locks.h"
+#include "scheduler.h"
+#include "registers.h"
+#include "clock.h"
+#include "smp.h"
 
 #define IDT_PRESENT        (1 << 7)
 #define IDT_DPL0           (0)
@@ -37,6 +41,9 @@ static struct idt_ptr       idt_ptr;
 static isr_handler_t        isr_handlers[256];
 extern uint32_t             isr_stub_table[];           /* Yes, this is an array, not a pointer */
 
+static uint64_t             irqs_off_since[MAX_CPUS];
+static uint64_t             irqs_off_max = 0;
+
 static void set_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags);
 extern void lidt(struct idt_ptr*);
 
@@ -68,11 +75,37 @@ static void set_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags)
     idt_entries[num].flags   = flags;
 }
 
+void irq_latency_begin()
+{
+    irqs_off_since[cpu_id()] = clock_ns();
+}
+
+/* With the kernel lock held */
+void irq_latency_end()
+{
+    uint64_t elapsed = clock_ns() - irqs_off_since[cpu_id()];
+    if(elapsed > irqs_off_max)
+        irqs_off_max = elapsed;
+}
+
+uint64_t irq_latency_max()
+{
+    return irqs_off_max;
+}
+
 /*
  * TODO: Use a pointer here, instead of passing this struct by value
  */
 void isr_handler(struct isr_regs regs)
 {
+    /* Nested syscalls of the kernel were already running with interrupts off */
+    bool irqs_were_on = regs.eflags & EFLAGS_IF;
+    if(irqs_were_on)
+        irq_latency_begin();
+
+    /* Released on return, or handed over if the handler switches tasks */
+    kernel_lock();
+
     if(isr_handlers[regs.int_no]) {
         isr_handlers[regs.int_no](&regs);
     } else {
@@ -94,6 +127,12 @@ void isr_handler(struct isr_regs regs)
         );
         abort();
     }
+
+    scheduler_isr_return();
+
+    if(irqs_were_on)
+        irq_latency_end();
+    kernel_unlock();
 }
 
 void idt_install(int num, isr_handler_t handler, bool usermode)
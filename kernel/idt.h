@@ -17,6 +17,15 @@ void idt_flush();
 void idt_install(int num, isr_handler_t handler, bool usermode);
 isr_handler_t idt_get_handler(int num);
 
+/*
+ * Interrupt latency: the longest a cpu ran kernel code with interrupts
+ * disabled, from the kernel entry or a preemption point until the return
+ * or the next preemption point. Measured by isr_handler() and task_preempt_point()
+ */
+void irq_latency_begin();
+void irq_latency_end();
+uint64_t irq_latency_max();         /* ns */
+
 
 
 
@@ -8,6 +8,11 @@
 #include "scheduler.h"
 #include "util.h"
 #include "registers.h"
+#include "clock.h"
+#include "lock_stats.h"
+
+/* Log every delivered message along with the time it spent queued */
+#undef IPC_TRACE
 
 static struct port_list port_list = {0};
 static spinlock_t port_list_lock = SPINLOCK_INIT;
@@ -21,7 +26,7 @@ static struct port* port_get(int number)
 
     if(number >= 0) {
         enter_critical_section();
-        checked_lock(&port_list_lock);
+        spin_lock(&port_list_lock);
 
         list_foreach(port, check, &port_list, node) {
             if(check->number == number) {
@@ -29,7 +34,7 @@ static struct port* port_get(int number)
                 break;
             }
         }
-        checked_unlock(&port_list_lock);
+        spin_unlock(&port_list_lock);
         leave_critical_section();
     }
     return port;
@@ -50,17 +55,17 @@ static uint32_t syscall_portopen_handler(struct isr_regs* regs)
     int port_number = regs->ebx;
 
     if(port_number == INVALID_PORT) {
-        checked_lock(&port_list_lock);
+        spin_lock(&port_list_lock);
         port_number = next_port_value++;
-        checked_unlock(&port_list_lock);
+        spin_unlock(&port_list_lock);
     } else {
-        checked_lock(&port_list_lock);
+        spin_lock(&port_list_lock);
         if(BITTEST(reserved_ports, port_number)) {
             port_number = INVALID_PORT;                           /* Already reserved */
         } else {
             BITSET(reserved_ports, port_number);
         }
-        checked_unlock(&port_list_lock);
+        spin_unlock(&port_list_lock);
     }
 
     if(port_number != INVALID_PORT) {
@@ -73,9 +78,9 @@ static uint32_t syscall_portopen_handler(struct isr_regs* regs)
         result->lock = SPINLOCK_INIT;
         list_init(&result->queue);
 
-        checked_lock(&port_list_lock);
+        spin_lock(&port_list_lock);
         list_append(&port_list, result, node);
-        checked_unlock(&port_list_lock);
+        spin_unlock(&port_list_lock);
 
         leave_critical_section();
     }
@@ -124,20 +129,22 @@ static uint32_t syscall_msgsend_handler(struct isr_regs* regs)
     assert(msg_copy->checksum == checksum);
 
     msg_copy->sender = current_task_pid();
+    msg_copy->timestamp = clock_ns();
     msg_copy->checksum = message_checksum(msg_copy);
     kernel_heap_check();
 
     /* Add message to port's queue */
-    checked_lock(&port->lock);
+    spin_lock(&port->lock);
     list_append(&port->queue, msg_copy, node);
-    checked_unlock(&port->lock);
+    spin_unlock(&port->lock);
     kernel_heap_check();
 
-    /* Wake receiver */
-    task_wake(port->receiver);
-
-    /* Block ourselves, receiver will wake us when it has successfully called msgrecv() on our message */
-    task_block(INVALID_PORT, INVALID_PORT, SLEEP_INFINITE);
+    /* 
+     * Wake receiver and block ourselves, receiver will wake us when it has successfully
+     * called msgrecv() on our message. If it was waiting in msgrecv(), switch to it directly:
+     * this covers both requests and replies of RPCs
+     */
+    task_handoff_block(port->receiver, INVALID_PORT, INVALID_PORT, SLEEP_INFINITE);
 
     return 0;
 }
@@ -173,9 +180,9 @@ static uint32_t syscall_msgrecv_handler(struct isr_regs* regs)
         return 2;
 
     while(true) {
-        checked_lock(&port->lock);
+        spin_lock(&port->lock);
         bool empty = list_empty(&port->queue);
-        checked_unlock(&port->lock);
+        spin_unlock(&port->lock);
 
         if(!empty)
             break;
@@ -188,7 +195,7 @@ static uint32_t syscall_msgrecv_handler(struct isr_regs* regs)
 
     uint32_t result;
 
-    checked_lock(&port->lock);
+    spin_lock(&port->lock);
     struct message* message = list_head(&port->queue);
 
     /* Validate message */
@@ -201,6 +208,15 @@ static uint32_t syscall_msgrecv_handler(struct isr_regs* regs)
     if(outsize)
         *outsize = sizeof(struct message) + message->len;
     if(buffer_size >= sizeof(struct message) + message->len) {
+#ifdef IPC_TRACE
+        trace("ipc: %d -> %d, port: %d, code: %d, len: %d, queued: %d ns",
+              message->sender,
+              current_task_pid(),
+              port_number,
+              message->code,
+              message->len,
+              (uint32_t)(clock_ns() - message->timestamp));
+#endif
         memcpy(buffer, message, sizeof(struct message) + message->len);
         list_remove(&port->queue, message, node);
 
@@ -213,7 +229,7 @@ static uint32_t syscall_msgrecv_handler(struct isr_regs* regs)
     } else {
         result = 3;
     }
-    checked_unlock(&port->lock);
+    spin_unlock(&port->lock);
 
     return result;
 }
@@ -240,9 +256,9 @@ static uint32_t syscall_msgwait_handler(struct isr_regs* regs)
         return (uint32_t)-1;
 
     while(true) {
-        checked_lock(&port->lock);
+        spin_lock(&port->lock);
         bool empty = list_empty(&port->queue);
-        checked_unlock(&port->lock);
+        spin_unlock(&port->lock);
 
         if(!empty)
             break;
@@ -267,18 +283,20 @@ static uint32_t syscall_msgpeek_handler(struct isr_regs* regs)
 
     struct port* port = port_get(port_number);
     if(port) {
-        checked_lock(&port->lock);
+        spin_lock(&port->lock);
         if(current_task_pid() == port->receiver) {
             if(!list_empty(&port->queue))
                 result = 1;
         }
-        checked_unlock(&port->lock);
+        spin_unlock(&port->lock);
     }
     return result;
 }
 
 void ipc_init()
 {
+    lock_stats_register(&port_list_lock.stats, "port_list");
+
     syscall_register(SYSCALL_PORTOPEN, syscall_portopen_handler);
     syscall_register(SYSCALL_MSGSEND, syscall_msgsend_handler);
     syscall_register(SYSCALL_MSGRECV, syscall_msgrecv_handler);
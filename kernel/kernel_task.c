@@ -13,6 +13,9 @@
 #include "kernel.h"
 #include "kmalloc.h"
 #include "io.h"
+#include "timer.h"
+#include "idt.h"
+#include "lock_stats.h"
 
 #include "kernel_task_server.h"
 
@@ -35,6 +38,60 @@ int handle_kernel_get_task_info(int sender_pid, int pid, /* out */ void* buffer,
     }
 }
 
+int handle_kernel_get_task_stats(int sender_pid, int pid, /* out */ void* buffer, /* in, out */ size_t* buffer_size)
+{
+    if(*buffer_size < sizeof(struct task_stats))
+        return -1;
+
+    struct task_stats* ts = buffer;
+
+    enter_critical_section();
+    bool success = get_task_stats(ts, pid);
+    leave_critical_section();
+
+    if(!success) {
+        return -1;
+    } else {
+        *buffer_size = sizeof(struct task_stats);
+        return 0;
+    }
+}
+
+int handle_kernel_get_lock_stats(int sender_pid, int index, /* out */ void* buffer, /* in, out */ size_t* buffer_size)
+{
+    if(*buffer_size < sizeof(struct lock_info))
+        return -1;
+
+    enter_critical_section();
+    bool success = lock_stats_get(index, buffer);
+    leave_critical_section();
+
+    if(!success) {
+        return -1;
+    } else {
+        *buffer_size = sizeof(struct lock_info);
+        return 0;
+    }
+}
+
+long long handle_kernel_get_ticks_avoided(int sender_pid)
+{
+    enter_critical_section();
+    uint64_t ret = timer_ticks_avoided();
+    leave_critical_section();
+
+    return ret;
+}
+
+long long handle_kernel_get_irq_latency(int sender_pid)
+{
+    enter_critical_section();
+    uint64_t ret = irq_latency_max();
+    leave_critical_section();
+
+    return ret;
+}
+
 void handle_kernel_reboot(int sender_pid)
 {
     trace("Reboot requested by pid %d", sender_pid);
@@ -52,17 +109,9 @@ void kernel_task_entry()
     }
 
     // start init
-    int pid = syscall(SYSCALL_FORK, 0, 0, 0, 0, 0);
-    if(!pid) {
-        enter_critical_section();
-        current_task_set_name("init.elf");
-        leave_critical_section();
-
-        const struct initrd_file* init_file = initrd_get_file("init.elf");
-        assert(init_file != NULL);
-
-        elf_entry_t entry = load_elf(init_file->data, init_file->size);
-        jump_to_usermode(entry);
+    int pid = task_spawn("init.elf", NULL);
+    if(pid == INVALID_PID) {
+        panic("Failed to start init.elf");
     }
 
     // Dispatch messages
@@ -20,6 +20,9 @@
 #include "debug.h"
 #include "initrd.h"
 #include "scheduler.h"
+#include "clock.h"
+#include "smp.h"
+#include "fpu.h"
 
 static void pf_handler(struct isr_regs* regs)
 {
@@ -27,6 +30,14 @@ static void pf_handler(struct isr_regs* regs)
     bool write = regs->err_code & (1 << 1);     /* was a read or a write */
     bool prot_violation = regs->err_code & 1;   /* not-present page or page protection violation */
     void* address = (void*)read_cr2();
+    /* Write to a page shared by fork() */
+    if(write && prot_violation && vmm_resolve_cow(address))
+        return;
+
+    /* First access to a page populated on demand */
+    if(!prot_violation && task_resolve_fault(address))
+        return;
+
     const char* function = lookup_function(regs->eip);
 
     trace(
@@ -110,11 +121,12 @@ static void reboot_timer(void* data, const struct isr_regs* regs)
 void kmain(struct multiboot_info* init_multiboot_info)
 {
     /*
-     * Init debug/loggin functions
+     * Init clocksource, used for log timestamps
      */
-    kdebug_init();
+    clock_init();
 
     trace("*** Booted ***");
+    trace("TSC frequency: %d kHz", (uint32_t)(clock_tsc_hz() / 1000));
  
     /*
      * This function will adjust multiboot info structure addresses
@@ -140,6 +152,9 @@ void kmain(struct multiboot_info* init_multiboot_info)
     idt_install(14, pf_handler, true);
     idt_install(13, gpf_handler, true);
 
+    // FPU
+    fpu_init();
+
     // Physical memory manager
     pmm_init(multiboot_get_info());
 
@@ -189,6 +204,9 @@ void kmain(struct multiboot_info* init_multiboot_info)
             pmm_reserve(page);
     }
 
+    // Processors, while low memory is still mapped
+    smp_init();
+
     // Virtual memory manager
     vmm_init();
     // By this point, multiboot data is not valid anymore
@@ -201,10 +219,14 @@ void kmain(struct multiboot_info* init_multiboot_info)
 
     // Syscall handlers
     syscall_init();
+    clock_syscall_init();
 
     // IPC System
     ipc_init();
 
+    // Application processors
+    smp_start();
+
     // Start system
     scheduler_start();
 
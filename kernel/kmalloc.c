@@ -9,6 +9,7 @@
 #include "string.h"
 #include "multiboot.h"
 #include "vmm.h"
+#include "lock_stats.h"
 
 struct heap* kernel_heap = NULL;
 static bool trace_enabled = false;
@@ -18,6 +19,7 @@ void kmalloc_init(void* start)
     unsigned char* heap_start = (unsigned char*)ALIGN((uint32_t)start, PAGE_SIZE);
     unsigned max_size = 0xC0400000 - (uint32_t)heap_start;
     kernel_heap = heap_init(heap_start, PAGE_SIZE * 64, max_size);
+    lock_stats_register(&kernel_heap->lock.stats, "kernel_heap");
 }
 
 void* kmalloc(unsigned size)
@@ -0,0 +1,32 @@
+#include "lock_stats.h"
+#include "clock.h"
+#include "string.h"
+#include "kdebug.h"
+
+static struct lock_stats* tracked_locks[MAX_TRACKED_LOCKS] = {0};
+static int tracked_count = 0;
+
+void lock_stats_register(struct lock_stats* stats, const char* name)
+{
+    assert(tracked_count < MAX_TRACKED_LOCKS);
+
+    stats->name = name;
+    tracked_locks[tracked_count++] = stats;
+}
+
+bool lock_stats_get(int index, struct lock_info* info)
+{
+    if(index < 0 || index >= tracked_count)
+        return false;
+
+    const struct lock_stats* stats = tracked_locks[index];
+
+    bzero(info, sizeof(struct lock_info));
+    strlcpy(info->name, stats->name, sizeof(info->name));
+    info->acquisitions = stats->acquisitions;
+    info->contended = stats->contended;
+    info->wait_ns = clock_cycles_to_ns(stats->wait_cycles);
+    info->hold_ns = clock_cycles_to_ns(stats->hold_cycles);
+    info->max_hold_ns = clock_cycles_to_ns(stats->max_hold_cycles);
+    return true;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdbool.h>
+#include "spinlock.h"
+#include "task_info.h"
+
+/*
+ * Registry of the kernel locks whose statistics can be queried at runtime
+ * Locks stay registered for good, only long-lived ones should be
+ */
+#define MAX_TRACKED_LOCKS   32
+
+void lock_stats_register(struct lock_stats* stats, const char* name);
+
+/* Statistics of the index-th registered lock, false past the last one */
+bool lock_stats_get(int index, struct lock_info* info);
@@ -0,0 +1,58 @@
+#include "mutex.h"
+#include "scheduler.h"
+#include "locks.h"
+#include "registers.h"
+#include "string.h"
+#include "util.h"
+#include "kdebug.h"
+
+void mutex_init(struct mutex* mutex, const char* name)
+{
+    bzero(mutex, sizeof(struct mutex));
+    mutex->owner = INVALID_PID;
+    mutex->stats.name = name;
+}
+
+void mutex_lock(struct mutex* mutex)
+{
+    assert(!interrupts_enabled());
+    assert(mutex->owner != current_task_pid());
+
+    uint64_t start = rdtsc();
+    bool contended = false;
+
+    /* Woken waiters race with new lockers, the loser sleeps again */
+    while(mutex->owner != INVALID_PID) {
+        contended = true;
+        mutex->waiters++;
+        task_block_on(mutex);
+        mutex->waiters--;
+    }
+
+    mutex->owner = current_task_pid();
+    lock_stats_acquired(&mutex->stats, start, contended);
+}
+
+bool mutex_trylock(struct mutex* mutex)
+{
+    assert(!interrupts_enabled());
+
+    if(mutex->owner != INVALID_PID)
+        return false;
+
+    mutex->owner = current_task_pid();
+    lock_stats_acquired(&mutex->stats, rdtsc(), false);
+    return true;
+}
+
+void mutex_unlock(struct mutex* mutex)
+{
+    assert(!interrupts_enabled());
+    assert(mutex->owner == current_task_pid());
+
+    lock_stats_released(&mutex->stats);
+    mutex->owner = INVALID_PID;
+
+    if(mutex->waiters)
+        task_wake_on(mutex, 1);
+}
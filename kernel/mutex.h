@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+#include "spinlock.h"
+
+/*
+ * Sleeping mutex
+ * Waiters block in the scheduler instead of spinning, so it may be held
+ * across preemption points (see task_preempt_point()) and blocking calls.
+ * Like all kernel state it is used with the kernel lock held. Not recursive
+ */
+struct mutex {
+    int owner;                      /* pid of the holder, INVALID_PID if free */
+    unsigned waiters;
+    struct lock_stats stats;
+};
+
+void mutex_init(struct mutex* mutex, const char* name);
+void mutex_lock(struct mutex* mutex);
+bool mutex_trylock(struct mutex* mutex);
+void mutex_unlock(struct mutex* mutex);
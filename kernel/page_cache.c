@@ -0,0 +1,70 @@
+#include "page_cache.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "kmalloc.h"
+#include "string.h"
+#include "list.h"
+#include "kdebug.h"
+
+#define PAGE_CACHE_BUCKETS  64
+
+struct cached_page {
+    list_declare_node(cached_page) node;
+    const unsigned char* data;
+    uint32_t size;
+    uint32_t frame;
+};
+list_declare(cached_page_list, cached_page);
+
+static struct cached_page_list buckets[PAGE_CACHE_BUCKETS] = {0};
+
+static struct cached_page_list* page_cache_bucket(const unsigned char* data)
+{
+    return &buckets[((uint32_t)data / PAGE_SIZE) % PAGE_CACHE_BUCKETS];
+}
+
+uint32_t page_cache_get(const unsigned char* data, uint32_t size)
+{
+    assert(size && size <= PAGE_SIZE);
+
+    struct cached_page_list* bucket = page_cache_bucket(data);
+    list_foreach(cached_page, page, bucket, node) {
+        if(page->data == data && page->size == size) {
+            pmm_ref(page->frame);
+            return page->frame;
+        }
+    }
+
+    uint32_t frame = pmm_alloc();
+    assert(frame != INVALID_FRAME);
+
+    unsigned char* va = vmm_transient_map(frame, VMM_PAGE_PRESENT | VMM_PAGE_WRITABLE);
+    memcpy(va, data, size);
+    bzero(va + size, PAGE_SIZE - size);
+    vmm_transient_unmap(va);
+
+    struct cached_page* page = kmalloc(sizeof(struct cached_page));
+    bzero(page, sizeof(struct cached_page));
+    page->data = data;
+    page->size = size;
+    page->frame = frame;
+    list_append(bucket, page, node);
+
+    /* One reference for the cache, one for the caller */
+    pmm_ref(frame);
+    return frame;
+}
+
+void page_cache_shrink()
+{
+    for(int i = 0; i < PAGE_CACHE_BUCKETS; i++) {
+        list_foreach(cached_page, page, &buckets[i], node) {
+            if(pmm_refcount(page->frame) > 1)
+                continue;
+
+            list_remove(&buckets[i], page, node);
+            pmm_free(page->frame);
+            kfree(page);
+        }
+    }
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Image page cache
+ *
+ * Frames holding read-only pages of initrd images, shared by every process
+ * mapping them. A page is keyed by the image bytes it was filled from,
+ * the rest of it is zero-filled. The cache holds a reference of its own on
+ * each frame, page_cache_shrink() drops the frames nobody else maps
+ */
+
+/* Frame holding size bytes of data, with a reference for the caller */
+uint32_t page_cache_get(const unsigned char* data, uint32_t size);
+void page_cache_shrink();
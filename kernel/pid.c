@@ -0,0 +1,96 @@
+#include "pid.h"
+#include <stdint.h>
+#include "scheduler.h"
+#include "kmalloc.h"
+#include "string.h"
+#include "debug.h"
+#include "pmm.h"
+
+/*
+ * Two-level radix table indexed by pid
+ * Each slot either holds a task pointer, or, for a freed pid, the
+ * next pid in the free list encoded as (next << 1) | SLOT_FREE.
+ * Task structures are at least 8-byte aligned so the low bit is
+ * never set on a pointer
+ */
+#define SLOTS_PER_PAGE      (PAGE_SIZE / sizeof(uintptr_t))
+#define PAGE_COUNT          (PID_MAX / SLOTS_PER_PAGE)
+#define SLOT_FREE           1
+
+static uintptr_t* pid_pages[PAGE_COUNT] = {0};
+
+static int next_fresh_pid = 0;          /* Never handed out before */
+static int free_head = INVALID_PID;     /* FIFO of freed pids */
+static int free_tail = INVALID_PID;
+static unsigned free_count = 0;
+
+static uintptr_t* pid_slot(int pid, bool create)
+{
+    if(pid < 0 || pid >= PID_MAX)
+        return NULL;
+
+    uintptr_t** page = &pid_pages[pid / SLOTS_PER_PAGE];
+    if(!*page) {
+        if(!create)
+            return NULL;
+
+        *page = kmalloc(PAGE_SIZE);
+        bzero(*page, PAGE_SIZE);
+    }
+    return &(*page)[pid % SLOTS_PER_PAGE];
+}
+
+int pid_alloc(struct task* task)
+{
+    assert(task);
+    assert(!((uintptr_t)task & SLOT_FREE));
+
+    int pid;
+    if(free_count && (free_count >= PID_REUSE_DELAY || next_fresh_pid == PID_MAX)) {
+        pid = free_head;
+
+        uintptr_t* slot = pid_slot(pid, false);
+        assert(slot && (*slot & SLOT_FREE));
+
+        free_head = (int)(*slot >> 1);
+        free_count--;
+        if(!free_count)
+            free_head = free_tail = INVALID_PID;
+    } else if(next_fresh_pid < PID_MAX) {
+        pid = next_fresh_pid++;
+    } else {
+        return INVALID_PID;
+    }
+
+    *pid_slot(pid, true) = (uintptr_t)task;
+    return pid;
+}
+
+void pid_free(int pid)
+{
+    uintptr_t* slot = pid_slot(pid, false);
+    assert(slot && *slot && !(*slot & SLOT_FREE));
+
+    *slot = SLOT_FREE;
+    if(free_count) {
+        uintptr_t* tail = pid_slot(free_tail, false);
+        *tail = (((uintptr_t)pid) << 1) | SLOT_FREE;
+    } else {
+        free_head = pid;
+    }
+    free_tail = pid;
+    free_count++;
+}
+
+struct task* pid_lookup(int pid)
+{
+    uintptr_t* slot = pid_slot(pid, false);
+    if(!slot || (*slot & SLOT_FREE))
+        return NULL;
+    return (struct task*)*slot;
+}
+
+int pid_limit()
+{
+    return next_fresh_pid;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+
+/*
+ * PID allocator and pid -> task lookup table
+ *
+ * PIDs are in [0, PID_MAX). Freed pids are recycled in FIFO order,
+ * but only once PID_REUSE_DELAY of them are pending, so that a pid
+ * is not handed out again right after its previous owner exited.
+ */
+#define PID_MAX             32768
+#define PID_REUSE_DELAY     64
+
+struct task;
+
+int pid_alloc(struct task* task);       /* Returns INVALID_PID if no pid is available */
+void pid_free(int pid);
+struct task* pid_lookup(int pid);       /* Returns NULL if pid is not allocated */
+int pid_limit();                        /* One past the highest pid handed out so far */
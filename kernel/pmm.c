@@ -12,6 +12,7 @@ struct memregion {
     uint32_t addr;
     uint32_t len;
     struct bitset* bitmap;
+    uint16_t* refcounts;        /* Owners of each allocated frame */
     struct memregion* next;
 };
 
@@ -38,6 +39,9 @@ static void add_region(uint32_t addr, uint32_t len)
     region->bitmap = kmalloc(alloc_size);
     bitset_init(region->bitmap, bitset_size);
 
+    region->refcounts = kmalloc(bitset_size * sizeof(uint16_t));
+    bzero(region->refcounts, bitset_size * sizeof(uint16_t));
+
     memregions = region;
 }
 
@@ -129,7 +133,14 @@ void pmm_free(uint32_t page)
                 trace("Error: page %p already free!", page);
                 abort();
             }
-            bitset_clear(region->bitmap, index);
+
+            /* Reserved frames have no count */
+            if(region->refcounts[index] > 1) {
+                region->refcounts[index]--;
+            } else {
+                region->refcounts[index] = 0;
+                bitset_clear(region->bitmap, index);
+            }
             leave_critical_section();
             return;
         }
@@ -168,6 +179,7 @@ uint32_t pmm_alloc()
         uint32_t index = bitset_find(region->bitmap, 0);
         if(index != BITSET_INVALID_INDEX) {
             bitset_set(region->bitmap, index);
+            region->refcounts[index] = 1;
             result = region->addr + (index * PAGE_SIZE);
             break;
         }
@@ -176,5 +188,44 @@ uint32_t pmm_alloc()
     return result;
 }
 
+static uint16_t* refcount(uint32_t page)
+{
+    for(struct memregion* region = memregions; region; region = region->next) {
+        if(page >= region->addr && page < region->addr + region->len) {
+            uint32_t index = (page - region->addr) / PAGE_SIZE;
+            assert(bitset_test(region->bitmap, index));
+            return &region->refcounts[index];
+        }
+    }
+
+    trace("Error: page %p not found!", page);
+    abort();
+    return NULL;
+}
+
+void pmm_ref(uint32_t page)
+{
+    assert(IS_ALIGNED(page, PAGE_SIZE));
+
+    enter_critical_section();
+
+    uint16_t* count = refcount(page);
+    assert(*count && *count < 0xFFFF);
+    (*count)++;
+
+    leave_critical_section();
+}
+
+unsigned pmm_refcount(uint32_t page)
+{
+    assert(IS_ALIGNED(page, PAGE_SIZE));
+
+    enter_critical_section();
+    unsigned result = *refcount(page);
+    leave_critical_section();
+
+    return result;
+}
+
 
 
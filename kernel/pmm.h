@@ -10,7 +10,9 @@ bool pmm_initialized();
 void pmm_reserve(uint32_t page);
 bool pmm_exists(uint32_t page);
 bool pmm_reserved(uint32_t page);
-void pmm_free(uint32_t page);
+void pmm_free(uint32_t page);                /* Drops a reference, the frame is freed with the last one */
+void pmm_ref(uint32_t page);                 /* One more owner, e.g. a copy-on-write mapping */
+unsigned pmm_refcount(uint32_t page);
 
 #define INVALID_FRAME 0xFFFFFFFF
 uint32_t pmm_alloc(); /* Returns PMM_INVALID_PAGE on error */
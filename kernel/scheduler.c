@@ -16,113 +16,848 @@
 #include "kdebug.h"
 #include "util.h"
 #include "kernel_task.h"
+#include "sched.h"
+#include "pid.h"
+#include "clock.h"
+#include "smp.h"
+#include "fpu.h"
+#include "workqueue.h"
+#include "mutex.h"
+#include "page_cache.h"
+#include "kernel.h"
 
 /************************************************************************************
  * Task state structure
  ************************************************************************************/
+/* Scheduler quantum, PIT driven on the BSP and local APIC driven on the other cpus */
+#define SCHEDULER_QUANTUM_MS    50
+
+/*
+ * A woken task preempts a running task of the same priority once both
+ * slept and ran for at least this long, see wakeup_preempt()
+ */
+#define WAKEUP_GRANULARITY_NS   1000000
+
+/*
+ * Real-time class limits
+ * Utilization is budget / relative deadline, in RT_UTIL_ONE fixed point.
+ * Admission keeps the real-time utilization of every cpu under RT_UTIL_MAX,
+ * so that normal tasks are never starved
+ */
+#define RT_UTIL_ONE             (1 << 16)
+#define RT_UTIL_MAX             (RT_UTIL_ONE * 9 / 10)
+#define RT_MIN_PERIOD_US        1000
+#define RT_MAX_PERIOD_US        10000000
+
+enum task_state {
+    TASK_RUNNING = 0,               /* current_task, or idle_task, of a cpu */
+    TASK_READY,                     /* In ready_queue */
+    TASK_SLEEPING,                  /* In sleeping_queue */
+    TASK_EXITED                     /* In exited_queue */
+};
+
 struct task {
     list_declare_node(task) node;
+    list_declare_node(task) wait_node;  /* port_waiters bucket when wait_cansend_port is set */
+    list_declare_node(task) futex_node; /* futex_waiters bucket when wait_futex is set */
+    enum task_state state;
     int pid;
+    int priority;                   /* PRIORITY_HIGHEST .. PRIORITY_LOWEST */
+    int cpu;                        /* cpu running it or queuing it, else the last one */
+    unsigned lock_depth;            /* Kernel lock depth to restore when switched back in */
     char name[TASK_NAME_MAX];
-    struct pagedir* pagedir;
+    struct address_space* as;       /* Shared with the other threads of the process */
+    unsigned thread_slot;           /* User stack slot it runs on, see thread.h */
     struct context context;
-    uint8_t iomap[65536 / 8];
+    unsigned char* kernel_stack;    /* KERNEL_STACK_SIZE bytes, holds its interrupt frames */
+    struct iomap* iomap;            /* Hardware port permissions, NULL for the default */
+
+    /* FPU state, allocated on first use */
+    struct fpu_state* fpu;
+    int fpu_cpu;                    /* cpu whose registers last loaded fpu, -1 if none */
 
     /* Waking condition */
     int wait_canrecv_port;          /* Wait until port has a message to receive */
     int wait_cansend_port;          /* Wait until port is open and can receive messages */
-    uint64_t sleep_deadline;
+    uint32_t wait_futex;            /* Wait for futex_wake() on this user address, 0 if none */
+    bool futex_woken;               /* Last futex wait ended by futex_wake() */
+    uint64_t sleep_deadline;        /* clock_ns() timestamp, 0 if none */
+    int sleep_index;                /* Position in sleep_heap, -1 if not in it */
+
+    /*
+     * Real-time class, scheduled earliest deadline first before normal tasks
+     * Each job runs for at most rt_budget until rt_deadline, then the task is
+     * throttled until its next release
+     */
+    bool rt;
+    int rt_cpu;                     /* cpu it was admitted on */
+    uint64_t rt_period;             /* ns */
+    uint64_t rt_relative_deadline;  /* ns, <= rt_period */
+    uint64_t rt_budget;             /* ns, <= rt_relative_deadline */
+    uint32_t rt_utilization;
+    uint64_t rt_release;            /* clock_ns() of the current job release */
+    uint64_t rt_deadline;           /* clock_ns() deadline of the current job */
+    int64_t rt_runtime;             /* Budget left for the current job */
+    bool rt_throttled;              /* Sleeping until its next release */
+
+    /* Accounting, see task_set_state() */
+    uint64_t state_since;           /* clock_ns() of the last state change */
+    struct sched_stats stats;
+
+    unsigned check_mark;            /* Used by scheduler_perform_checks() */
 };
 list_declare(task_list, task);
 
+/*
+ * User address space, shared by the threads of a process
+ */
+struct address_space {
+    struct pagedir* pagedir;
+    unsigned users;                 /* Tasks running in it, not yet collected */
+    uint32_t thread_slots;          /* Bit n set when user stack slot n is in use, see thread.h */
+    struct mutex map_lock;          /* Held while changing the mappings, across preemption points */
+    struct vma_list vmas;           /* Its user memory, changed under map_lock, see vma.h */
+};
+
+/*
+ * Ready tasks, one FIFO per priority level
+ * Bit n of bitmap is set when levels[n] is non-empty, so the most urgent
+ * ready task is always at the head of levels[bsf(bitmap)]
+ */
+struct run_queue {
+    struct task_list levels[PRIORITY_LEVELS];
+    uint32_t bitmap;
+    unsigned nr_ready;
+    struct task_list rt_tasks;      /* Ready real-time tasks, unordered */
+};
+
+/*
+ * Per-cpu scheduler state
+ */
+struct cpu_sched {
+    struct task* current;
+    struct task* idle;
+    struct run_queue ready_queue;   /* Tasks ready to be run on this cpu */
+    struct task* fpu_owner;         /* Task whose state the FPU registers hold */
+    uint32_t rt_utilization;        /* Sum of the real-time tasks admitted on this cpu */
+    bool need_resched;              /* Preempt current task on the way out of the interrupt, see wakeup_preempt() */
+};
+
 /************************************************************************************
  * queues
  ************************************************************************************/
-/* Tasks ready to be run */
-static struct task_list ready_queue = {0};
+static struct cpu_sched cpu_sched[MAX_CPUS] = {0};
 
 /* Tasks sleeping until a condition is met */
 static struct task_list sleeping_queue = {0};
 
-/* Exited tasks waiting to be collected */
+/*
+ * Sleeping tasks with a deadline, as a binary min-heap on sleep_deadline
+ * The next task to wake is always sleep_heap[0]
+ */
+static struct task** sleep_heap = NULL;
+static unsigned sleep_heap_size = 0;
+static unsigned sleep_heap_capacity = 0;
+
+/*
+ * Sleeping tasks waiting for a port to be able to receive messages,
+ * hashed by port number. Chained through task->wait_node
+ */
+#define PORT_WAIT_BUCKETS   32
+static struct task_list port_waiters[PORT_WAIT_BUCKETS] = {0};
+
+/*
+ * Sleeping tasks waiting in futex_wait() or task_block_on(), hashed by
+ * address space and address. Chained through task->futex_node
+ */
+#define FUTEX_WAIT_BUCKETS  32
+static struct task_list futex_waiters[FUTEX_WAIT_BUCKETS] = {0};
+
+/* Exited tasks waiting to be collected, see collect_exited_tasks() */
 static struct task_list exited_queue = {0};
+static struct work collect_work;
 
 /************************************************************************************
  * declarations
  ************************************************************************************/
-static int next_pid_value = 0;
-static struct task* current_task = NULL;
-static struct task* idle_task = NULL;
+#define this_sched()        (&cpu_sched[cpu_id()])
+#define current_task        (this_sched()->current)
+#define idle_task           (this_sched()->idle)
 
 static void scheduler_perform_checks();
+static void address_space_release(struct address_space* as);
+static unsigned futex_wake_tasks(const struct address_space* as, uint32_t addr, unsigned count);
+
+/************************************************************************************
+ * accounting
+ ************************************************************************************/
+/*
+ * Counter of stats to charge the time spent in the current state of task to
+ * Time spent sleeping counts as blocked unless the only waking condition is a deadline
+ */
+static uint64_t* task_state_counter(const struct task* task, struct sched_stats* stats)
+{
+    switch(task->state) {
+    case TASK_RUNNING:
+        return &stats->run_ns;
+    case TASK_READY:
+        return &stats->ready_ns;
+    case TASK_SLEEPING:
+        if(task->sleep_deadline &&
+           task->wait_canrecv_port == INVALID_PORT &&
+           task->wait_cansend_port == INVALID_PORT)
+            return &stats->sleep_ns;
+        return &stats->blocked_ns;
+    default:
+        return NULL;
+    }
+}
+
+/*
+ * Change task state, charging the time since the last change to the state left
+ * Waking conditions must still be set when leaving TASK_SLEEPING
+ */
+static void task_set_state(struct task* task, enum task_state state)
+{
+    uint64_t now = clock_ns();
+
+    uint64_t* counter = task_state_counter(task, &task->stats);
+    if(counter)
+        *counter += now - task->state_since;
+
+    if(task->rt && task->state == TASK_RUNNING)
+        task->rt_runtime -= now - task->state_since;
+
+    task->state = state;
+    task->state_since = now;
+}
 
 /************************************************************************************
  * Implementation
  ************************************************************************************/
 
+static bool run_queue_empty(const struct run_queue* rq)
+{
+    return !rq->bitmap && list_empty(&rq->rt_tasks);
+}
+
 /*
- * Save task state (regs) into task structure
+ * Ready real-time task with the earliest deadline, or NULL
+ * There are only ever a handful of them, a scan is cheap enough
  */
-static void save_task_state(struct task* task, const struct isr_regs* regs)
+static struct task* rt_queue_earliest(struct run_queue* rq)
 {
-    /*
-     * Save current process context
-     * When task is resumed from save state, control resumes
-     * after the interrupt call
-     * From ring0: useresp is invalid
-     */
-    unsigned descriptor_mask = ~0x3;
-    if((regs->cs & descriptor_mask) == KERNEL_CODE_SEG) {
-        task->context.esp = regs->esp + (5 * sizeof(uint32_t));
-    } else if((regs->cs & descriptor_mask) == USER_CODE_SEG) {
-        task->context.esp = regs->useresp;
+    struct task* result = NULL;
+    list_foreach(task, task, &rq->rt_tasks, node) {
+        if(!result || task->rt_deadline < result->rt_deadline)
+            result = task;
+    }
+    return result;
+}
+
+/*
+ * Budget left to the current job of a real-time task, including the time it
+ * has been running for if it is running
+ */
+static int64_t rt_runtime_left(const struct task* task)
+{
+    int64_t result = task->rt_runtime;
+    if(task->state == TASK_RUNNING)
+        result -= clock_ns() - task->state_since;
+    return result;
+}
+
+/*
+ * A real-time task woke up: keep its current job if the budget left still fits in
+ * its bandwidth until the job deadline, else start a new one (constant bandwidth server)
+ */
+static void rt_wakeup(struct task* task, uint64_t now)
+{
+    if(now >= task->rt_deadline ||
+       task->rt_runtime <= 0 ||
+       (uint64_t)task->rt_runtime * task->rt_relative_deadline >
+            (task->rt_deadline - now) * task->rt_budget) {
+        task->rt_release = now;
+        task->rt_deadline = now + task->rt_relative_deadline;
+        task->rt_runtime = task->rt_budget;
+    }
+}
+
+/*
+ * Whether the ready queue of cpu holds a real-time task that must run before its current task
+ */
+static bool rt_should_preempt(int cpu)
+{
+    struct cpu_sched* sched = &cpu_sched[cpu];
+    struct task* next = rt_queue_earliest(&sched->ready_queue);
+    if(!next)
+        return false;
+
+    struct task* current = sched->current;
+    return current == sched->idle || !current->rt || next->rt_deadline < current->rt_deadline;
+}
+
+static bool cpu_is_idle(int cpu)
+{
+    return cpu_sched[cpu].current == cpu_sched[cpu].idle &&
+           run_queue_empty(&cpu_sched[cpu].ready_queue);
+}
+
+static bool task_is_idle(const struct task* task)
+{
+    for(int cpu = 0; cpu < cpu_count(); cpu++) {
+        if(cpu_sched[cpu].idle == task)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Pick the cpu to queue a task on: the current cpu when requeueing its own
+ * current task, else the cpu it last ran on if it is idle, else any idle cpu
+ */
+static int select_cpu(const struct task* task)
+{
+    /* Real-time tasks stay on the cpu that admitted them */
+    if(task->rt)
+        return task->rt_cpu;
+    if(task == current_task)
+        return cpu_id();
+    if(cpu_is_idle(task->cpu))
+        return task->cpu;
+
+    for(int cpu = 0; cpu < cpu_count(); cpu++) {
+        if(cpu_is_idle(cpu))
+            return cpu;
+    }
+    return task->cpu;
+}
+
+/*
+ * A task was queued on cpu, make sure it is noticed
+ */
+static void kick_cpu(int cpu)
+{
+    /* Somebody is waiting for the cpu, quantums matter again */
+    if(cpu == BSP_CPU)
+        timer_tickless_exit();
+
+    if(cpu != cpu_id() && cpu_sched[cpu].current == cpu_sched[cpu].idle) {
+        lapic_send_ipi(cpu, IPI_RESCHEDULE);
+    } else if(rt_should_preempt(cpu)) {
+        /* Ourselves on the way out of this syscall or interrupt, others by IPI */
+        if(cpu == cpu_id())
+            cpu_sched[cpu].need_resched = true;
+        else
+            lapic_send_ipi(cpu, IPI_RESCHEDULE);
+    }
+}
+
+/*
+ * Append task to the tail of its priority level, or to the real-time tasks,
+ * on the cpu picked by select_cpu()
+ */
+static void ready_queue_push(struct task* task)
+{
+    assert(task->priority >= PRIORITY_HIGHEST && task->priority <= PRIORITY_LOWEST);
+
+    int cpu = select_cpu(task);
+    struct run_queue* rq = &cpu_sched[cpu].ready_queue;
+
+    task_set_state(task, TASK_READY);
+    task->cpu = cpu;
+    if(task->rt) {
+        list_append(&rq->rt_tasks, task, node);
     } else {
-        panic("Invalid cs value: %p", regs->cs);
+        list_append(&rq->levels[task->priority], task, node);
+        rq->bitmap |= (1 << task->priority);
+        rq->nr_ready++;
     }
 
-    task->context.cs = regs->cs;
-    task->context.ds = task->context.ss = regs->ds;
-    task->context.eflags = regs->eflags;
-    task->context.eip = regs->eip;
-    task->context.edi = regs->edi;
-    task->context.esi = regs->esi;
-    task->context.edx = regs->edx;
-    task->context.ecx = regs->ecx;
-    task->context.ebx = regs->ebx;
-    task->context.eax = regs->eax;
-    task->context.ebp = regs->ebp;
+    kick_cpu(cpu);
+}
+
+static void ready_queue_remove(struct task* task)
+{
+    struct run_queue* rq = &cpu_sched[task->cpu].ready_queue;
+    if(task->rt) {
+        list_remove(&rq->rt_tasks, task, node);
+        return;
+    }
+
+    struct task_list* level = &rq->levels[task->priority];
+
+    list_remove(level, task, node);
+    if(list_empty(level))
+        rq->bitmap &= ~(1 << task->priority);
+    rq->nr_ready--;
 }
 
 /*
- * Save current task state
- * Should only be called from syscall_handler()
+ * Pop the most urgent normal task, or NULL if there is none
  */
-void save_current_task_state(const struct isr_regs* regs)
+static struct task* ready_queue_pop_normal(struct run_queue* rq)
 {
-    assert(current_task);
-    assert(!interrupts_enabled());
+    if(!rq->bitmap)
+        return NULL;
 
-    save_task_state(current_task, regs);
+    struct task* task = list_head(&rq->levels[bsf(rq->bitmap)]);
+    ready_queue_remove(task);
+    return task;
 }
 
-/* Switch to specified task */
-static void task_switch(struct task* task)
+/*
+ * Pop the real-time task with the earliest deadline, else the most urgent normal task
+ */
+static struct task* ready_queue_pop(struct run_queue* rq)
+{
+    struct task* task = rt_queue_earliest(rq);
+    if(task) {
+        ready_queue_remove(task);
+        return task;
+    }
+
+    return ready_queue_pop_normal(rq);
+}
+
+/*
+ * Whether rq holds a task that must run before task
+ */
+static bool ready_queue_preempts(struct run_queue* rq, const struct task* task)
+{
+    struct task* rt = rt_queue_earliest(rq);
+    if(rt)
+        return !task->rt || rt->rt_deadline < task->rt_deadline;
+    if(task->rt)
+        return false;
+    return rq->bitmap && bsf(rq->bitmap) < task->priority;
+}
+
+/*
+ * Work stealing: take the most urgent task of the cpu with the most ready tasks
+ */
+static struct task* ready_queue_steal()
+{
+    struct run_queue* busiest = NULL;
+    for(int cpu = 0; cpu < cpu_count(); cpu++) {
+        struct run_queue* rq = &cpu_sched[cpu].ready_queue;
+        if(rq->nr_ready && (!busiest || rq->nr_ready > busiest->nr_ready))
+            busiest = rq;
+    }
+
+    /* Real-time tasks are never stolen */
+    return busiest ? ready_queue_pop_normal(busiest) : NULL;
+}
+
+static bool ready_queue_contains(const struct task* t)
+{
+    return t->state == TASK_READY;
+}
+
+static void sleep_heap_swap(unsigned a, unsigned b)
+{
+    struct task* tmp = sleep_heap[a];
+    sleep_heap[a] = sleep_heap[b];
+    sleep_heap[b] = tmp;
+
+    sleep_heap[a]->sleep_index = a;
+    sleep_heap[b]->sleep_index = b;
+}
+
+static void sleep_heap_sift_up(unsigned index)
+{
+    while(index) {
+        unsigned parent = (index - 1) / 2;
+        if(sleep_heap[parent]->sleep_deadline <= sleep_heap[index]->sleep_deadline)
+            break;
+
+        sleep_heap_swap(parent, index);
+        index = parent;
+    }
+}
+
+static void sleep_heap_sift_down(unsigned index)
+{
+    while(true) {
+        unsigned smallest = index;
+        unsigned left = (index * 2) + 1;
+        unsigned right = left + 1;
+
+        if(left < sleep_heap_size &&
+           sleep_heap[left]->sleep_deadline < sleep_heap[smallest]->sleep_deadline)
+            smallest = left;
+        if(right < sleep_heap_size &&
+           sleep_heap[right]->sleep_deadline < sleep_heap[smallest]->sleep_deadline)
+            smallest = right;
+
+        if(smallest == index)
+            break;
+
+        sleep_heap_swap(index, smallest);
+        index = smallest;
+    }
+}
+
+static void sleep_heap_insert(struct task* task)
+{
+    assert(task->sleep_index == -1);
+    assert(task->sleep_deadline);
+
+    if(sleep_heap_size == sleep_heap_capacity) {
+        unsigned capacity = sleep_heap_capacity ? sleep_heap_capacity * 2 : 16;
+        struct task** heap = kmalloc(capacity * sizeof(struct task*));
+        if(sleep_heap_size)
+            memcpy(heap, sleep_heap, sleep_heap_size * sizeof(struct task*));
+        kfree(sleep_heap);
+
+        sleep_heap = heap;
+        sleep_heap_capacity = capacity;
+    }
+
+    task->sleep_index = sleep_heap_size++;
+    sleep_heap[task->sleep_index] = task;
+    sleep_heap_sift_up(task->sleep_index);
+}
+
+static void sleep_heap_remove(struct task* task)
+{
+    unsigned index = task->sleep_index;
+    assert(index < sleep_heap_size && sleep_heap[index] == task);
+
+    sleep_heap_size--;
+    if(index != sleep_heap_size) {
+        sleep_heap[index] = sleep_heap[sleep_heap_size];
+        sleep_heap[index]->sleep_index = index;
+
+        sleep_heap_sift_up(index);
+        sleep_heap_sift_down(sleep_heap[index]->sleep_index);
+    }
+
+    task->sleep_index = -1;
+}
+
+static struct task_list* port_waiters_bucket(int port_number)
+{
+    return &port_waiters[((unsigned)port_number) % PORT_WAIT_BUCKETS];
+}
+
+static struct task_list* futex_waiters_bucket(const struct address_space* as, uint32_t addr)
+{
+    /* Kernel addresses are the same in every address space */
+    if(addr >= KERNEL_BASE_ADDR)
+        as = NULL;
+
+    return &futex_waiters[(((uint32_t)as >> 4) ^ (addr >> 2)) % FUTEX_WAIT_BUCKETS];
+}
+
+/*
+ * Put current task into the sleeping queue and index it by its waking conditions
+ */
+static void task_sleep(struct task* task)
+{
+    task_set_state(task, TASK_SLEEPING);
+    list_append(&sleeping_queue, task, node);
+
+    if(task->sleep_deadline)
+        sleep_heap_insert(task);
+
+    if(task->wait_cansend_port != INVALID_PORT)
+        list_append(port_waiters_bucket(task->wait_cansend_port), task, wait_node);
+
+    if(task->wait_futex)
+        list_append(futex_waiters_bucket(task->as, task->wait_futex), task, futex_node);
+}
+
+/*
+ * Remove a task from the sleeping queue and every index
+ * The caller queues it or switches to it
+ */
+static void task_unblock_detach(struct task* task)
+{
+    assert(task->state == TASK_SLEEPING);
+
+    task_set_state(task, TASK_READY);
+    task->stats.wakeups++;
+
+    list_remove(&sleeping_queue, task, node);
+
+    if(task->sleep_index != -1)
+        sleep_heap_remove(task);
+
+    if(task->wait_cansend_port != INVALID_PORT)
+        list_remove(port_waiters_bucket(task->wait_cansend_port), task, wait_node);
+
+    if(task->wait_futex)
+        list_remove(futex_waiters_bucket(task->as, task->wait_futex), task, futex_node);
+
+    task->wait_canrecv_port = INVALID_PORT;
+    task->wait_cansend_port = INVALID_PORT;
+    task->wait_futex = 0;
+    task->sleep_deadline = 0;
+
+    task->rt_throttled = false;
+    if(task->rt)
+        rt_wakeup(task, task->state_since);
+}
+
+/*
+ * Budget of the current job of a real-time task is exhausted,
+ * put it to sleep until its next release
+ */
+static void rt_throttle(struct task* task)
+{
+    task->wait_canrecv_port = INVALID_PORT;
+    task->wait_cansend_port = INVALID_PORT;
+    task->sleep_deadline = task->rt_release + task->rt_period;
+    task->rt_throttled = true;
+
+    task_sleep(task);
+}
+
+/*
+ * Move task back to the normal class, giving back its utilization
+ */
+static void rt_leave(struct task* task)
+{
+    if(!task->rt)
+        return;
+
+    cpu_sched[task->rt_cpu].rt_utilization -= task->rt_utilization;
+
+    bool queued = task->state == TASK_READY;
+    if(queued)
+        ready_queue_remove(task);
+
+    task->rt = false;
+    task->rt_throttled = false;
+
+    if(queued)
+        ready_queue_push(task);
+}
+
+/*
+ * Whether a task woken after sleeping for slept ns must run before curr
+ * Real-time tasks are left to rt_should_preempt()
+ */
+static bool wakeup_preempts(const struct task* task, const struct task* curr, uint64_t slept)
+{
+    if(task->rt || curr->rt)
+        return false;
+    if(task->priority != curr->priority)
+        return task->priority < curr->priority;
+
+    /* Sleep credit: tasks that mostly wait get the cpu ahead of those that mostly run */
+    return slept >= WAKEUP_GRANULARITY_NS &&
+           clock_ns() - curr->state_since >= WAKEUP_GRANULARITY_NS;
+}
+
+/*
+ * Wakeup preemption: a woken task more urgent than the one running on its cpu
+ * gets it at the end of the current syscall or interrupt, not at the next tick
+ */
+static void wakeup_preempt(struct task* task, uint64_t slept)
+{
+    int cpu = task->cpu;
+    struct cpu_sched* sched = &cpu_sched[cpu];
+
+    /* Idle cpus are kicked by ready_queue_push() */
+    if(sched->current == sched->idle || !wakeup_preempts(task, sched->current, slept))
+        return;
+
+    /* Run ahead of the other tasks of its level */
+    struct task_list* level = &sched->ready_queue.levels[task->priority];
+    list_remove(level, task, node);
+    list_prepend(level, task, node);
+
+    sched->need_resched = true;
+    if(cpu != cpu_id())
+        lapic_send_ipi(cpu, IPI_RESCHEDULE);
+}
+
+/*
+ * Remove a task from the sleeping queue and every index, and make it ready
+ */
+static void task_unblock(struct task* task)
+{
+    uint64_t slept = clock_ns() - task->state_since;
+
+    task_unblock_detach(task);
+    ready_queue_push(task);
+    wakeup_preempt(task, slept);
+}
+
+/*
+ * Wake every sleeping task whose deadline has passed
+ * Only looks at the top of sleep_heap, so it's cheap enough to run every tick
+ */
+static void sleep_heap_expire(uint64_t now)
+{
+    while(sleep_heap_size && sleep_heap[0]->sleep_deadline <= now) {
+        task_unblock(sleep_heap[0]);
+    }
+}
+
+/*
+ * Lazy FPU switch
+ * The outgoing task's registers are only written back if it used the FPU
+ * during its slice (TS clear), and they stay loaded: the incoming task only
+ * skips the #NM trap when it is still the one they belong to
+ */
+static void fpu_switch(struct task* prev, struct task* next)
+{
+    struct cpu_sched* sched = this_sched();
+
+    if(prev && sched->fpu_owner == prev && !fpu_trapping())
+        fpu_save(prev->fpu);
+
+    fpu_trap(sched->fpu_owner != next || next->fpu_cpu != cpu_id());
+}
+
+/*
+ * #NM: current task used the FPU for the first time since it was switched in
+ */
+static void fpu_trap_handler(struct isr_regs* regs)
+{
+    struct task* task = current_task;
+    struct cpu_sched* sched = this_sched();
+
+    /* Whatever the registers hold was saved when its task was switched out */
+    fpu_trap(false);
+
+    if(!task->fpu) {
+        task->fpu = kmalloc_a(sizeof(struct fpu_state), 16);
+        fpu_state_init(task->fpu);
+    }
+    fpu_restore(task->fpu);
+
+    sched->fpu_owner = task;
+    task->fpu_cpu = cpu_id();
+}
+
+/*
+ * Write back task FPU registers if they are live on this cpu
+ */
+static void fpu_sync(struct task* task)
+{
+    if(this_sched()->fpu_owner == task && task->fpu_cpu == cpu_id() && !fpu_trapping())
+        fpu_save(task->fpu);
+}
+
+/*
+ * Forget task FPU state, registers loaded from it on any cpu become stale
+ */
+static void fpu_release(struct task* task)
+{
+    for(int cpu = 0; cpu < cpu_count(); cpu++) {
+        if(cpu_sched[cpu].fpu_owner == task)
+            cpu_sched[cpu].fpu_owner = NULL;
+    }
+    if(task == current_task)
+        fpu_trap(true);
+
+    kfree(task->fpu);
+    task->fpu = NULL;
+    task->fpu_cpu = -1;
+}
+
+/*
+ * Prepare the kernel stack of a new task: its first switch_context()
+ * returns into task_start(), which leaves the kernel through the returned frame
+ */
+static struct isr_regs* task_init_stack(struct task* task)
+{
+    unsigned char* top = task->kernel_stack + KERNEL_STACK_SIZE - sizeof(struct isr_regs);
+    struct isr_regs* frame = (struct isr_regs*)top;
+    bzero(frame, sizeof(struct isr_regs));
+
+    /* Popped by switch_context(): edi, esi, ebx, ebp, then its return address */
+    uint32_t* esp = (uint32_t*)top;
+    *--esp = (uint32_t)task_start;
+    for(int i = 0; i < 4; i++)
+        *--esp = 0;
+
+    task->context.esp = (uint32_t)esp;
+    task->lock_depth = 1;
+    return frame;
+}
+
+/*
+ * First thing run by a new task, see task_start()
+ * It leaves the kernel right away, like the end of isr_handler()
+ */
+void task_started()
+{
+    kernel_lock_resume(current_task->lock_depth);
+    kernel_unlock();
+}
+
+/*
+ * Switch to specified task
+ * new_slice is false when the task runs on the rest of the previous task's quantum
+ * Returns once the current task is switched back in, the kernel lock is
+ * held throughout and passed along with the cpu
+ */
+static void task_switch(struct task* task, bool new_slice)
 {
     assert(task);
     assert(!interrupts_enabled());
 
     //trace("Switching to task %s", task->name);
+
+    struct task* prev = current_task;
+    fpu_switch(prev, task);
+    this_sched()->need_resched = false;
     
     current_task = task;
+    task_set_state(current_task, TASK_RUNNING);
+    current_task->cpu = cpu_id();
 
     scheduler_perform_checks();
 
-    vmm_copy_kernel_mappings(task->pagedir);
-    tss_set_kernel_stack(KERNEL_STACK + PAGE_SIZE);
-    gdt_iomap_set(task->iomap, sizeof(task->iomap));
-    switch_context(&task->context);
+    tss_set_kernel_stack(task->kernel_stack + KERNEL_STACK_SIZE);
+    gdt_iomap_load(task->iomap);
+
+    if(cpu_id() == BSP_CPU) {
+        /* 
+         * Nothing else can run until the next sleeper wakes,
+         * there is no point in taking the periodic tick
+         */
+        if(run_queue_empty(&this_sched()->ready_queue)) {
+            uint64_t deadline = sleep_heap_size ? sleep_heap[0]->sleep_deadline : 0;
+
+            /* Still enforce the budget of a real-time task */
+            if(task->rt) {
+                uint64_t exhausted = task->state_since + (task->rt_runtime > 0 ? task->rt_runtime : 0);
+                if(!deadline || exhausted < deadline)
+                    deadline = exhausted;
+            }
+            timer_tickless_enter(deadline);
+        }
+    } else {
+        /* Application processors only preempt real tasks, woken by IPI otherwise */
+        if(task == idle_task) {
+            lapic_timer_stop();
+        } else if(task->rt) {
+            /* Interrupt it when its budget runs out */
+            uint32_t budget_ms = 1;
+            if(task->rt_runtime > 0)
+                budget_ms = (task->rt_runtime + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+            lapic_timer_oneshot(budget_ms < SCHEDULER_QUANTUM_MS ? budget_ms : SCHEDULER_QUANTUM_MS);
+        } else if(new_slice) {
+            lapic_timer_oneshot(SCHEDULER_QUANTUM_MS);
+        }
+    }
+
+    if(task == prev)
+        return;
 
-    panic("Invalid code path");
+    /* Nothing to save when leaving the boot stack */
+    struct context unused;
+    if(prev)
+        prev->lock_depth = kernel_lock_depth();
+    switch_context(prev ? &prev->context : &unused, &task->context);
+
+    kernel_lock_resume(prev->lock_depth);
 }
 
 /* 
@@ -133,74 +868,186 @@ static void task_switch(struct task* task)
  */
 static void task_switch_next()
 {
-    struct task* next_task = NULL;
-
     /* Awake sleeping tasks whose deadline has arrived */
-    uint64_t now = timer_timestamp();
-
-    list_foreach(task, task, &sleeping_queue, node) {
-        if(task->sleep_deadline && now >= task->sleep_deadline) {
-            next_task = task;
-            list_remove(&sleeping_queue, task, node);
-            break;
-        }
-    }
+    sleep_heap_expire(clock_ns());
 
-    if(!next_task) {
-        /* No awoken tasks, get task from ready queue */
-        next_task = list_head(&ready_queue);
-        if(next_task) {
-            list_remove(&ready_queue, next_task, node);
-        }
+    /* Get most urgent task from this cpu's ready queue, else from the busiest cpu */
+    struct task* next_task;
+    while((next_task = ready_queue_pop(&this_sched()->ready_queue)) &&
+          next_task->rt && next_task->rt_runtime <= 0) {
+        rt_throttle(next_task);
     }
+    if(!next_task)
+        next_task = ready_queue_steal();
 
     if(!next_task) {
         /* Else run idle task */
         next_task = idle_task;
     }
 
-    task_switch(next_task);
+    task_switch(next_task, true);
 }
 
-static void scheduler_timer(void* data, const struct isr_regs* regs)
+/*
+ * Put back the preempted current task into the ready queue
+ * A real-time task out of budget is throttled instead
+ */
+static void task_requeue(struct task* task)
 {
-    /* Save current task state */
-    assert(current_task);
-    save_task_state(current_task, regs);
+    if(task == idle_task)
+        return;
 
-    scheduler_perform_checks();
+    task->stats.involuntary_switches++;
+    if(task->rt && rt_runtime_left(task) <= 0)
+        rt_throttle(task);
+    else
+        ready_queue_push(task);
+}
+
+/*
+ * Preempt current task and switch to the next one
+ * Returns when the current task is resumed
+ */
+static void task_preempt()
+{
+    task_requeue(current_task);
+    task_switch_next();
+}
 
-    /* Push current task into ready queue */
-    if(current_task != idle_task) {
-        //trace("Pushing %s into ready queue", current_task->name);
-        list_append(&ready_queue, current_task, node);
+/*
+ * Interrupt handlers do not switch tasks themselves: the rest of the
+ * interrupt (e.g. the other timer callbacks) would only run once the
+ * current task is resumed. They ask for it, see scheduler_isr_return()
+ */
+static void task_preempt_deferred()
+{
+    this_sched()->need_resched = true;
+}
+
+void task_preempt_point()
+{
+    assert(!interrupts_enabled());
+
+    /* Nested syscalls and critical sections cannot be left */
+    if(!current_task || kernel_lock_depth() != 1)
+        return;
+
+    /* Let pending interrupts and the other cpus in */
+    irq_latency_end();
+    kernel_unlock();
+    sti();
+    cpu_relax();
+    cli();
+    kernel_lock();
+    irq_latency_begin();
+
+    if(this_sched()->need_resched)
+        task_preempt();
+}
+
+void task_flush_tlb_others()
+{
+    if(!current_task || cpu_count() == 1)
+        return;
+
+    /* Other address spaces are not in their TLB, switching pagedirs flushed it */
+    uint32_t mask = 0;
+    for(int cpu = 0; cpu < cpu_count(); cpu++) {
+        struct task* task = cpu_sched[cpu].current;
+        if(cpu != cpu_id() && task && task->as == current_task->as)
+            mask |= 1 << cpu;
     }
 
-    /* Collect exited tasks */
+    smp_tlb_shootdown(mask);
+}
+
+void scheduler_isr_return()
+{
+    /* Only when the interrupted code held no kernel lock */
+    if(this_sched()->need_resched && kernel_lock_depth() == 1)
+        task_preempt();
+}
+
+/*
+ * Runs on every timer tick
+ * When the idle task is interrupted and a task became ready,
+ * switch right away instead of waiting for the scheduler timer.
+ * Likewise when a real-time task must run, or ran out of budget
+ */
+static void sleep_timer(void* data, const struct isr_regs* regs)
+{
+    sleep_heap_expire(clock_ns());
+
+    bool preempt = rt_should_preempt(cpu_id());
+    if(current_task == idle_task)
+        preempt |= !run_queue_empty(&this_sched()->ready_queue);
+    else if(current_task->rt)
+        preempt |= rt_runtime_left(current_task) <= 0;
+
+    if(preempt)
+        task_preempt_deferred();
+}
+
+/*
+ * Local APIC quantum of an application processor expired
+ */
+static void lapic_timer_handler(struct isr_regs* regs)
+{
+    lapic_eoi();
+
+    task_preempt_deferred();
+}
+
+/*
+ * A task was queued on this cpu while it was idle,
+ * or a real-time task was queued that must run before the current one
+ */
+static void reschedule_ipi_handler(struct isr_regs* regs)
+{
+    lapic_eoi();
+
+    /* need_resched may already be set by wakeup_preempt() */
+    if(current_task == idle_task || rt_should_preempt(cpu_id()))
+        task_preempt_deferred();
+}
+
+static bool cpu_runs_task(int cpu)
+{
+    return cpu_sched[cpu].current != cpu_sched[cpu].idle;
+}
+
+/*
+ * Free exited tasks, deferred to the system workqueue by the exit syscalls
+ */
+static void collect_exited_tasks(void* data)
+{
     list_foreach(task, task, &exited_queue, node) {
         trace("Collecting task %s (%d)", task->name, task->pid);
 
         list_remove(&exited_queue, task, node);
-        vmm_destroy_pagedir(task->pagedir);
+        address_space_release(task->as);
+        pid_free(task->pid);
+        fpu_release(task);
+        kfree(task->iomap);
+        kfree(task->kernel_stack);
         kfree(task);
     }
+}
+
+static void scheduler_timer(void* data, const struct isr_regs* regs)
+{
+    assert(current_task);
 
-    /* If no more tasks to run, reboot */
-    bool moretasks = true;
+    scheduler_perform_checks();
 
-    if(list_empty(&ready_queue) &&
-       list_empty(&sleeping_queue)) {
-        moretasks = false;
-    } else if(list_empty(&ready_queue)) {
-        bool may_wakeup = false;
-        list_foreach(task, task, &sleeping_queue, node) {
-            if(task->sleep_deadline != 0) {
-                may_wakeup = false;
-                break;
-            }
-        }
-        if(!may_wakeup)
-            moretasks = false;
+    /* 
+     * If no more tasks to run, reboot
+     * Tasks sleeping without a deadline can only be woken by another task
+     */
+    bool moretasks = sleep_heap_size;
+    for(int cpu = 0; cpu < cpu_count(); cpu++) {
+        if(!run_queue_empty(&cpu_sched[cpu].ready_queue) || cpu_runs_task(cpu))
+            moretasks = true;
     }
 
     if(!moretasks) {
@@ -209,50 +1056,78 @@ static void scheduler_timer(void* data, const struct isr_regs* regs)
     }
 
     /* Switch to next task */
-    task_switch_next();
-    invalid_code_path();
+    task_preempt_deferred();
 }
 
 void task_iomap_set(struct task* task, int port, int allow)
 {
     assert(port >= 0 && port < 65536);
 
-    int idx = port / 8;
-    int off = port % 8;
-    uint8_t mask = 1 << off;
-
-    if(allow)
-        task->iomap[idx] &= ~mask;
-    else
-        task->iomap[idx] |= mask;
+    /* Most tasks never leave the default permissions */
+    if(!task->iomap) {
+        if(iomap_test(NULL, port) == !allow)
+            return;
+        task->iomap = kmalloc(sizeof(struct iomap));
+        iomap_init(task->iomap);
+    }
+    iomap_allow(task->iomap, port, allow);
 }
 
 bool task_iomap_test(const struct task* task, int port)
 {
-    assert(port >= 0 && port < 65536);
+    return iomap_test(task->iomap, port);
+}
+
+static struct address_space* address_space_create(struct pagedir* pagedir, uint32_t thread_slots)
+{
+    struct address_space* as = kmalloc(sizeof(struct address_space));
+    as->pagedir = pagedir;
+    as->users = 0;
+    as->thread_slots = thread_slots;
+    mutex_init(&as->map_lock, "address_space");
+    list_init(&as->vmas);
+    return as;
+}
 
-    int idx = port / 8;
-    int off = port % 8;
-    uint8_t mask = 1 << off;
+/*
+ * Drop a reference of a collected task, the last one frees the user memory
+ */
+static void address_space_release(struct address_space* as)
+{
+    assert(as->users);
 
-    return (task->iomap[idx] & mask);
+    if(--as->users == 0) {
+        vmm_destroy_pagedir(as->pagedir);
+        vma_clear(&as->vmas);
+        page_cache_shrink();
+        kfree(as);
+    }
 }
 
 /*
  * Create a new task structure (but does not push it to any queues)
  */
-static struct task* task_create(const char* name)
+static struct task* task_create(const char* name, struct address_space* as)
 {
     struct task* result = kmalloc(sizeof(struct task));
     bzero(result, sizeof(struct task));
-    memset(result->iomap, 0xFF, sizeof(result->iomap));
-    task_iomap_set(result, DEBUG_PORT, 1);
 
-    result->pid = next_pid_value++;
-    assert(result->pid < 64);
+    result->pid = pid_alloc(result);
+    if(result->pid == INVALID_PID) {
+        panic("Out of pids");
+    }
+    result->priority = PRIORITY_NORMAL;
+    result->wait_canrecv_port = INVALID_PORT;
+    result->wait_cansend_port = INVALID_PORT;
+    result->sleep_index = -1;
+    result->fpu_cpu = -1;
+    result->state_since = clock_ns();
 
     strlcpy(result->name, name, sizeof(result->name));
-    result->pagedir = vmm_clone_pagedir();
+    result->as = as;
+    result->as->users++;
+    result->context.cr3 = vmm_get_physical(as->pagedir);
+    result->kernel_stack = kmalloc_a(KERNEL_STACK_SIZE, PAGE_SIZE);
 
     return result;
 }
@@ -262,33 +1137,11 @@ static struct task* task_create(const char* name)
  */
 static struct task* task_get(int pid)
 {
-    struct task* result = 0;
+    struct task* result = pid_lookup(pid);
 
-    if(pid == idle_task->pid)
-        result = idle_task;
-
-    if(!result) {
-        if(pid == current_task->pid)
-            result = current_task;
-    }
-
-    if(!result) {
-        list_foreach(task, task, &ready_queue, node) {
-            if(task->pid == pid) {
-                result = task;
-                break;
-            }
-        }
-    }
-
-    if(!result) {
-        list_foreach(task, task, &sleeping_queue, node) {
-            if(task->pid == pid) {
-                result = task;
-                break;
-            }
-        }
-    }
+    /* Exited tasks keep their pid until collected, but are gone for everyone else */
+    if(result && result->state == TASK_EXITED)
+        result = NULL;
 
     return result;
 }
@@ -296,21 +1149,45 @@ static struct task* task_get(int pid)
 /*
  * Put current task into sleeping queue
  */
-void task_block(int canrecv_port, int cansend_port, unsigned timeout)
+static void task_set_waiting(int canrecv_port, int cansend_port, unsigned timeout_us)
 {
-    assert(!interrupts_enabled());
-
     current_task->wait_canrecv_port = canrecv_port;
     current_task->wait_cansend_port = cansend_port;
-    if(timeout != SLEEP_INFINITE) {
+    if(timeout_us == SLEEP_INFINITE) {
         current_task->sleep_deadline = 0;
     } else {
-        current_task->sleep_deadline = timer_timestamp() + timeout;
+        current_task->sleep_deadline = clock_ns() + timeout_us * NSEC_PER_USEC;
     }
-    syscall(SYSCALL_BLOCK, 0, 0, 0, 0, 0);
+}
+
+/*
+ * Put current task into sleeping queue
+ */
+void task_block(int canrecv_port, int cansend_port, unsigned timeout_us)
+{
+    assert(!interrupts_enabled());
+
+    task_set_waiting(canrecv_port, cansend_port, timeout_us);
+    syscall(SYSCALL_BLOCK, INVALID_PID, 0, 0, 0, 0);
     //trace("After sleep");
 }
 
+/*
+ * Wake task pid and put current task into sleeping queue, switching
+ * straight to pid if it was sleeping
+ */
+void task_handoff_block(int pid, int canrecv_port, int cansend_port, unsigned timeout_us)
+{
+    assert(!interrupts_enabled());
+
+    /* We are obviously awake */
+    if(pid == current_task->pid)
+        pid = INVALID_PID;
+
+    task_set_waiting(canrecv_port, cansend_port, timeout_us);
+    syscall(SYSCALL_BLOCK, pid, 0, 0, 0, 0);
+}
+
 /*
  * Remove task from sleeping queue and put into ready queue
  */
@@ -319,42 +1196,111 @@ void task_wake(int pid)
     assert(!interrupts_enabled());
 
     struct task* t = task_get(pid);
-    assert(t);
+    if(!t) {
+        panic("Failed to wake task with PID %d", pid);
+    }
 
-    bool found = false;
+    /* Ready and running tasks are already awake, throttled ones wait for their release */
+    if(t->state == TASK_SLEEPING && !t->rt_throttled)
+        task_unblock(t);
+}
 
-    list_foreach(task, task, &sleeping_queue, node) {
-        if(task == t) {
-            list_remove(&sleeping_queue, task, node);
-            list_append(&ready_queue, t, node);
-            found = true;
-            break;
-        }
-    }
+bool task_resolve_fault(void* address)
+{
+    assert(!interrupts_enabled());
 
-    if(!found) {
-        list_foreach(task, task, &ready_queue, node) {
-            if(task == t) {
-                found = true;
-                break;
-            }
-        }
-    }
+    if(!current_task || (uint32_t)address >= KERNEL_BASE_ADDR)
+        return false;
+    return vma_fault(&current_task->as->vmas, address);
+}
 
-    if(!found) {
-        if(pid == current_task->pid)
-            found = true;
+/*
+ * Every user page belongs to a region, faults on them are resolved
+ * With the map lock held, so none can go away meanwhile
+ */
+static bool user_access_ok(struct address_space* as, uint32_t addr, size_t size, bool write)
+{
+    if(addr < USER_START || addr >= KERNEL_BASE_ADDR || size > KERNEL_BASE_ADDR - addr)
+        return false;
+
+    for(uint32_t page = TRUNCATE(addr, PAGE_SIZE); page < addr + size; ) {
+        struct vma* vma = vma_find(&as->vmas, page);
+        if(!vma || (write && !(vma->flags & VMM_PAGE_WRITABLE)))
+            return false;
+        page = vma->end;
     }
+    return true;
+}
+
+bool task_copy_from_user(void* dst, const void* src, size_t size)
+{
+    struct address_space* as = current_task->as;
+
+    mutex_lock(&as->map_lock);
+    bool result = user_access_ok(as, (uint32_t)src, size, false);
+    if(result)
+        memcpy(dst, src, size);
+    mutex_unlock(&as->map_lock);
+
+    return result;
+}
+
+bool task_copy_to_user(void* dst, const void* src, size_t size)
+{
+    struct address_space* as = current_task->as;
 
-    if(!found) {
-        if(pid == idle_task->pid) {
-            found = true;
+    mutex_lock(&as->map_lock);
+    bool result = user_access_ok(as, (uint32_t)dst, size, true);
+    if(result)
+        memcpy(dst, src, size);
+    mutex_unlock(&as->map_lock);
+
+    return result;
+}
+
+bool task_copy_string_from_user(char* dst, const char* src, size_t size)
+{
+    assert(size);
+    struct address_space* as = current_task->as;
+
+    mutex_lock(&as->map_lock);
+
+    /* Validated a page at a time, the string ends wherever its NUL is */
+    bool result = true;
+    size_t copied = 0;
+    while(copied < size - 1) {
+        uint32_t addr = (uint32_t)src + copied;
+        if(!user_access_ok(as, addr, 1, false)) {
+            result = false;
+            break;
         }
+
+        uint32_t page_end = TRUNCATE(addr, PAGE_SIZE) + PAGE_SIZE;
+        while(copied < size - 1 && (uint32_t)src + copied < page_end && src[copied])
+            dst[copied] = src[copied], copied++;
+        if(copied < size - 1 && (uint32_t)src + copied < page_end)
+            break;
     }
+    dst[copied] = 0;
+
+    mutex_unlock(&as->map_lock);
+    return result;
+}
+
+void task_block_on(const void* addr)
+{
+    assert(!interrupts_enabled());
+    assert((uint32_t)addr >= KERNEL_BASE_ADDR);
+
+    current_task->wait_futex = (uint32_t)addr;
+    task_block(INVALID_PORT, INVALID_PORT, SLEEP_INFINITE);
+}
 
-    if(!found) {
-        panic("Failed to wake task with PID %d", pid);
-    }
+unsigned task_wake_on(const void* addr, unsigned count)
+{
+    assert(!interrupts_enabled());
+
+    return futex_wake_tasks(NULL, (uint32_t)addr, count);
 }
 
 /*
@@ -364,9 +1310,9 @@ void wake_tasks_waiting_for_port(int port_number)
 {
     assert(!interrupts_enabled());
     
-    list_foreach(task, task, &sleeping_queue, node) {
+    list_foreach(task, task, port_waiters_bucket(port_number), wait_node) {
         if(task->wait_cansend_port == port_number) {
-            task_wake(task->pid);
+            task_unblock(task);
         }
     }
 }
@@ -399,7 +1345,35 @@ bool get_task_info(struct task_info* buffer, int pid)
         return false;
 
     buffer->pid = pid;
+    buffer->priority = task->priority;
+    strlcpy(buffer->name, task->name, sizeof(buffer->name));
+    return true;
+}
+
+/*
+ * Stats of the live task with the lowest pid >= pid, times are up to date
+ */
+bool get_task_stats(struct task_stats* buffer, int pid)
+{
+    assert(!interrupts_enabled());
+
+    struct task* task = NULL;
+    for(; pid >= 0 && pid < pid_limit() && !task; pid++)
+        task = task_get(pid);
+    if(!task)
+        return false;
+
+    buffer->pid = task->pid;
+    buffer->priority = task->priority;
+    buffer->cpu = task->cpu;
     strlcpy(buffer->name, task->name, sizeof(buffer->name));
+    buffer->timestamp = clock_ns();
+    buffer->sched = task->stats;
+
+    /* Charge the current state without changing it */
+    uint64_t* counter = task_state_counter(task, &buffer->sched);
+    if(counter)
+        *counter += buffer->timestamp - task->state_since;
     return true;
 }
 
@@ -410,10 +1384,10 @@ bool get_task_info(struct task_info* buffer, int pid)
  */
 static uint32_t syscall_yield_handler(struct isr_regs* regs)
 {
-    list_append(&ready_queue, current_task, node);
+    current_task->stats.voluntary_switches++;
+    ready_queue_push(current_task);
 
     task_switch_next();
-    invalid_code_path();
     return 0;
 }
 
@@ -427,12 +1401,33 @@ static uint32_t syscall_fork_handler(struct isr_regs* regs)
 {
     volatile int result = 0;
 
-    struct task* new_task = task_create(current_task->name);
-    save_task_state(new_task, regs);
-    new_task->context.cr3 = vmm_get_physical(new_task->pagedir);
-    new_task->context.eax = 0;
+    /* Kernel stacks are not duplicated, a ring0 caller could not be resumed in the child */
+    assert((regs->cs & RPL3) == RPL3);
+
+    /*
+     * The child leaves the kernel through a copy of our interrupt frame, only the calling thread is duplicated
+     * Pagetables and regions are copied under one map lock, our other threads cannot change either in between
+     */
+    mutex_lock(&current_task->as->map_lock);
+    struct pagedir* pagedir = vmm_clone_pagedir();
+    struct address_space* as = address_space_create(pagedir, 1 << current_task->thread_slot);
+    vma_clone(&as->vmas, &current_task->as->vmas);
+    mutex_unlock(&current_task->as->map_lock);
+    struct task* new_task = task_create(current_task->name, as);
+    new_task->thread_slot = current_task->thread_slot;
+    struct isr_regs* frame = task_init_stack(new_task);
+    *frame = *regs;
+    frame->eax = 0;
+    new_task->priority = current_task->priority;
+
+    /* The child inherits the FPU state */
+    if(current_task->fpu) {
+        fpu_sync(current_task);
+        new_task->fpu = kmalloc_a(sizeof(struct fpu_state), 16);
+        memcpy(new_task->fpu, current_task->fpu, sizeof(struct fpu_state));
+    }
 
-    list_append(&ready_queue, new_task, node);
+    ready_queue_push(new_task);
 
     result = new_task->pid;
 
@@ -441,8 +1436,12 @@ static uint32_t syscall_fork_handler(struct isr_regs* regs)
 
 static uint32_t syscall_exit_handler(struct isr_regs* regs)
 {
-    /* Put into exited queue, will be collected next time scheduler runs */
+    /* Put into exited queue, collected once we are switched out */
+    current_task->stats.voluntary_switches++;
+    rt_leave(current_task);
+    task_set_state(current_task, TASK_EXITED);
     list_append(&exited_queue, current_task, node);
+    schedule_work(&collect_work);
 
     task_switch_next();
     invalid_code_path();
@@ -450,26 +1449,63 @@ static uint32_t syscall_exit_handler(struct isr_regs* regs)
 }
 
 /*
- * Sleep current task for specified number of milliseconds
+ * Sleep current task for specified number of microseconds
  */
 static uint32_t syscall_sleep_handler(struct isr_regs* regs)
 {
-    unsigned millis = regs->ebx;
-    task_block(INVALID_PORT, INVALID_PORT, millis);
+    unsigned micros = regs->ebx;
+    task_block(INVALID_PORT, INVALID_PORT, micros);
     return 0;
 }
 
 /*
  * Put current task into sleeping queue and resume next task
+ * Params:
+ *  ebx         pid of a task to wake and switch to directly, or INVALID_PID
+ *              Kernel callers only (task_handoff_block()), ignored from ring3
  */
 static uint32_t syscall_block_handler(struct isr_regs* regs)
 {
-    list_append(&sleeping_queue, current_task, node);
+    /* A user process could otherwise wake any task, whatever it waits for */
+    int handoff_pid = (regs->cs & RPL3) == RPL3 ? INVALID_PID : (int)regs->ebx;
+    struct task* target = handoff_pid != INVALID_PID ? task_get(handoff_pid) : NULL;
+
+    current_task->stats.voluntary_switches++;
+    task_sleep(current_task);
+
+    /* 
+     * Direct handoff: the woken task runs on the rest of our quantum,
+     * unless it would jump ahead of a more urgent task waiting on this cpu
+     * Real-time tasks stay on their own cpu
+     */
+    if(target && target->state == TASK_SLEEPING && !target->rt_throttled) {
+        struct run_queue* rq = &this_sched()->ready_queue;
+
+        task_unblock_detach(target);
+        if((!target->rt || target->rt_cpu == cpu_id()) && !ready_queue_preempts(rq, target)) {
+            task_switch(target, false);
+            return 0;
+        }
+        ready_queue_push(target);
+    }
+
     task_switch_next();
-    invalid_code_path();
     return 0;
 }
 
+/*
+ * Give the thread using stack slot a fresh user stack, in the current address space
+ * Only its top page is populated right away, the stack grows on demand
+ * down to the guard page at the bottom of the slot
+ */
+static void map_user_stack(struct address_space* as, unsigned slot)
+{
+    uint32_t top = THREAD_STACK_TOP(slot);
+    vma_add(&as->vmas, top - THREAD_STACK_STRIDE + PAGE_SIZE, top,
+            VMM_PAGE_PRESENT | VMM_PAGE_WRITABLE | VMM_PAGE_USER, NULL, 0);
+    vma_fault(&as->vmas, (void*)(top - PAGE_SIZE));
+}
+
 static uint32_t syscall_exec_handler(struct isr_regs* regs)
 {
     char* filename = (char*)regs->ebx;
@@ -488,6 +1524,12 @@ static uint32_t syscall_exec_handler(struct isr_regs* regs)
           current_task_name(), 
           filename);
 
+    /* The other threads would lose their memory under them */
+    if(current_task->as->users > 1) {
+        trace("Cannot exec %s from a multithreaded process", filename);
+        return 0;
+    }
+
     /* Load file from initrd */
     const struct initrd_file* file = initrd_get_file(filename);
     if(!file) {
@@ -495,14 +1537,23 @@ static uint32_t syscall_exec_handler(struct isr_regs* regs)
         return 0;
     }
 
-    /* Unmap process memory */
+    /* Unmap process memory, only the main thread stack slot is used again */
+    mutex_lock(&current_task->as->map_lock);
     vmm_reset_current_pagedir();
+    vma_clear(&current_task->as->vmas);
+    page_cache_shrink();
+    current_task->as->thread_slots = 1;
+    current_task->thread_slot = 0;
+    fpu_release(current_task);
 
     /* Load elf file */
-    elf_entry_t entry = load_elf(file->data, file->size);
+    elf_entry_t entry = load_elf(file->data, file->size, &current_task->as->vmas);
+    map_user_stack(current_task->as, 0);
+    mutex_unlock(&current_task->as->map_lock);
 
-    /* Reset process state */
+    /* Reset process state, without arguments */
     current_task_set_name(filename_buf);
+    regs->ebx = 0;
     regs->esp = (uint32_t)(USER_STACK + PAGE_SIZE);
     regs->useresp = (uint32_t)(USER_STACK + PAGE_SIZE);
     regs->eflags = read_eflags() | EFLAGS_IF;
@@ -515,8 +1566,246 @@ static uint32_t syscall_exec_handler(struct isr_regs* regs)
     return 0;
 }
 
+int task_spawn(const char* filename, const char* args)
+{
+    enter_critical_section();
+
+    /* The caller's memory is not mapped while loading */
+    char filename_buf[TASK_NAME_MAX];
+    char args_buf[SPAWN_ARGS_MAX];
+    strlcpy(filename_buf, filename, sizeof(filename_buf));
+    strlcpy(args_buf, args ? args : "", sizeof(args_buf));
+
+    const struct initrd_file* file = initrd_get_file(filename_buf);
+    if(!file) {
+        trace("Failed to load %s", filename_buf);
+        leave_critical_section();
+        return INVALID_PID;
+    }
+
+    struct pagedir* pagedir = vmm_create_pagedir();
+    struct task* task = task_create(filename_buf, address_space_create(pagedir, 1));
+    task->priority = current_task->priority;
+
+    /* Load it from its own address space, args go on top of its stack */
+    vmm_switch_pagedir(pagedir);
+
+    elf_entry_t entry = load_elf(file->data, file->size, &task->as->vmas);
+    map_user_stack(task->as, 0);
+
+    size_t args_size = strlen(args_buf) + 1;
+    unsigned char* args_start = USER_STACK + PAGE_SIZE - ALIGN(args_size, sizeof(uint32_t));
+    memcpy(args_start, args_buf, args_size);
+
+    vmm_switch_pagedir(current_task->as->pagedir);
+
+    /* First entry into ring3, ebx holds args for the runtime */
+    struct isr_regs* frame = task_init_stack(task);
+    frame->cs = USER_CODE_SEG | RPL3;
+    frame->ds = frame->ss = USER_DATA_SEG | RPL3;
+    frame->useresp = (uint32_t)args_start;
+    frame->eflags = read_eflags() | EFLAGS_IF;
+    frame->eip = (uint32_t)entry;
+    frame->ebx = (uint32_t)args_start;
+
+    ready_queue_push(task);
+    int pid = task->pid;
+
+    leave_critical_section();
+    return pid;
+}
+
+/*
+ * Start a process straight from an initrd image
+ * Params:
+ *  ebx         filename
+ *  ecx         argument string, or NULL
+ * Returns:
+ *  pid of the new process, or INVALID_PID (also for invalid pointers)
+ */
+static uint32_t syscall_spawn_handler(struct isr_regs* regs)
+{
+    char filename[TASK_NAME_MAX];
+    char args[SPAWN_ARGS_MAX] = "";
+
+    if(!task_copy_string_from_user(filename, (const char*)regs->ebx, sizeof(filename)))
+        return INVALID_PID;
+    if(regs->ecx && !task_copy_string_from_user(args, (const char*)regs->ecx, sizeof(args)))
+        return INVALID_PID;
+
+    return task_spawn(filename, args);
+}
+
+/*
+ * Start a thread in the address space of the current task
+ * Params:
+ *  ebx         entry point, called as entry(ecx, edx) on a fresh user stack
+ *  ecx, edx    its arguments
+ * Returns:
+ *  pid of the thread, or INVALID_PID
+ */
+static uint32_t syscall_thread_create_handler(struct isr_regs* regs)
+{
+    struct address_space* as = current_task->as;
+
+    int slot = 0;
+    while(slot < MAX_THREADS && (as->thread_slots & (1 << slot)))
+        slot++;
+    if(slot == MAX_THREADS)
+        return INVALID_PID;
+    as->thread_slots |= 1 << slot;
+
+    mutex_lock(&as->map_lock);
+
+    /* The stack of a thread of the process we were forked from may be left there */
+    uint32_t top = THREAD_STACK_TOP(slot);
+    vma_unmap(&as->vmas, top - THREAD_STACK_STRIDE, top);
+    map_user_stack(as, slot);
+
+    /* entry(ecx, edx), never returning */
+    uint32_t* stack = (uint32_t*)top;
+    *--stack = regs->edx;
+    *--stack = regs->ecx;
+    *--stack = 0;
+
+    mutex_unlock(&as->map_lock);
+
+    struct task* task = task_create(current_task->name, as);
+    task->priority = current_task->priority;
+    task->thread_slot = slot;
+
+    struct isr_regs* frame = task_init_stack(task);
+    frame->cs = USER_CODE_SEG | RPL3;
+    frame->ds = frame->ss = USER_DATA_SEG | RPL3;
+    frame->useresp = (uint32_t)stack;
+    frame->eflags = read_eflags() | EFLAGS_IF;
+    frame->eip = regs->ebx;
+
+    ready_queue_push(task);
+    return task->pid;
+}
+
+/*
+ * Exit the current thread and free its user stack
+ * The main thread stack stays mapped, the process memory goes with its last thread
+ */
+static uint32_t syscall_thread_exit_handler(struct isr_regs* regs)
+{
+    struct address_space* as = current_task->as;
+    unsigned slot = current_task->thread_slot;
+
+    if(slot > 0 && as->users > 1) {
+        mutex_lock(&as->map_lock);
+
+        /*
+         * The other cpus running the process drop the stack from their TLB
+         * before vma_unmap() returns, the slot is only handed out again after
+         */
+        uint32_t top = THREAD_STACK_TOP(slot);
+        vma_unmap(&as->vmas, top - THREAD_STACK_STRIDE, top);
+        as->thread_slots &= ~(1 << slot);
+
+        mutex_unlock(&as->map_lock);
+    }
+
+    return syscall_exit_handler(regs);
+}
+
+/*
+ * Wake up to count tasks of as sleeping on the futex at addr
+ * as is ignored for kernel addresses
+ */
+static unsigned futex_wake_tasks(const struct address_space* as, uint32_t addr, unsigned count)
+{
+    unsigned woken = 0;
+
+    list_foreach(task, task, futex_waiters_bucket(as, addr), futex_node) {
+        if(woken == count)
+            break;
+        if(task->wait_futex == addr && (addr >= KERNEL_BASE_ADDR || task->as == as)) {
+            task->futex_woken = true;
+            task_unblock(task);
+            woken++;
+        }
+    }
+
+    return woken;
+}
+
+static bool futex_address_valid(uint32_t addr)
+{
+    return addr && !(addr % sizeof(uint32_t)) && addr < THREAD_STACKS_TOP;
+}
+
+/*
+ * Sleep until futex_wake() on addr, if it still holds the expected value
+ * Params:
+ *  ebx         user address
+ *  ecx         expected value
+ *  edx         timeout in microseconds, or SLEEP_INFINITE
+ * Returns:
+ *  FUTEX_WOKEN, FUTEX_AGAIN or FUTEX_TIMEDOUT
+ */
+static uint32_t syscall_futex_wait_handler(struct isr_regs* regs)
+{
+    uint32_t addr = regs->ebx;
+    if(!futex_address_valid(addr))
+        return FUTEX_AGAIN;
+
+    /*
+     * Checked under the kernel lock, a futex_wake() cannot slip in between
+     * An unmapped addr cannot hold the expected value either
+     */
+    uint32_t value;
+    if(!task_copy_from_user(&value, (const void*)addr, sizeof(value)) || value != regs->ecx)
+        return FUTEX_AGAIN;
+
+    current_task->wait_futex = addr;
+    current_task->futex_woken = false;
+    task_block(INVALID_PORT, INVALID_PORT, regs->edx);
+
+    return current_task->futex_woken ? FUTEX_WOKEN : FUTEX_TIMEDOUT;
+}
+
+/*
+ * Wake tasks of the current address space sleeping in futex_wait() on addr
+ * Params:
+ *  ebx         user address
+ *  ecx         maximum number of tasks to wake
+ * Returns:
+ *  number of tasks woken
+ */
+static uint32_t syscall_futex_wake_handler(struct isr_regs* regs)
+{
+    uint32_t addr = regs->ebx;
+    if(!futex_address_valid(addr))
+        return 0;
+
+    return futex_wake_tasks(current_task->as, addr, regs->ecx);
+}
+
+/*
+ * Check a range passed to mmap/munmap/mprotect
+ * The thread stack slots are managed by the kernel only
+ */
+static bool user_range_valid(uint32_t addr, size_t size)
+{
+    return IS_ALIGNED(addr, PAGE_SIZE) && IS_ALIGNED(size, PAGE_SIZE) &&
+           size > 0 && addr >= USER_START && addr < THREAD_STACK_TOP(MAX_THREADS) &&
+           size <= THREAD_STACK_TOP(MAX_THREADS) - addr;
+}
+
+static uint32_t user_prot_flags(uint32_t prot)
+{
+    uint32_t vmm_flags = VMM_PAGE_PRESENT | VMM_PAGE_USER;
+    if(prot & 0x2)
+        vmm_flags |= VMM_PAGE_WRITABLE;
+    return vmm_flags;
+}
+
 /*
  * mmap
+ * Anonymous memory, zero-filled page by page on first access
  * Params:
  *  ebx         addr
  *  ecx         size
@@ -527,64 +1816,81 @@ static uint32_t syscall_exec_handler(struct isr_regs* regs)
  */
 static uint32_t syscall_mmap_handler(struct isr_regs* regs)
 {
-    uint32_t result = 0;
-
-    void* addr = (void*)regs->ebx;
+    uint32_t addr = regs->ebx;
     size_t size = (size_t)regs->ecx;
     uint32_t flags = (uint32_t)regs->edx;
 
-    /* Must be aligned */
-    if(!IS_ALIGNED(addr, PAGE_SIZE) ||
-       !IS_ALIGNED(size, PAGE_SIZE)) {
+    if(!user_range_valid(addr, size) || flags == 0)
         return 0;
-    } else if(flags == 0) {
+
+    struct address_space* as = current_task->as;
+    mutex_lock(&as->map_lock);
+
+    /* Must not overlap existing mappings */
+    if(vma_overlaps(&as->vmas, addr, addr + size)) {
+        mutex_unlock(&as->map_lock);
         return 0;
     }
+    vma_add(&as->vmas, addr, addr + size, user_prot_flags(flags), NULL, 0);
 
-    /* Calculate flags */
-    uint32_t vmm_flags = VMM_PAGE_PRESENT | VMM_PAGE_USER;
-    if(flags & 0x2)
-        vmm_flags |= VMM_PAGE_WRITABLE;
+    mutex_unlock(&as->map_lock);
 
-    /* Check validity beforehand */
-    for(unsigned char* page = addr;
-        page < (unsigned char*)addr + size;
-        page += PAGE_SIZE) {
+    //trace("mmap(%p, %d, %d)", addr, size, flags);
 
-        /* Check if already mapped */
-        uint32_t va_flags = vmm_get_flags(page);
-        if(va_flags & VMM_PAGE_PRESENT) {
-            return 0;
-        }
+    return addr;
+}
 
-        /* Check if in valid memory area */
-        if((uint32_t)page < USER_START || (uint32_t)page > USER_END)
-            return 0;
-    }
+/*
+ * munmap
+ * Unmapping a range that is not mapped, even partly, is not an error
+ * Params:
+ *  ebx         addr
+ *  ecx         size
+ * Returns:
+ *  0           Success
+ *  -1          Error
+ */
+static uint32_t syscall_munmap_handler(struct isr_regs* regs)
+{
+    uint32_t addr = regs->ebx;
+    size_t size = (size_t)regs->ecx;
 
+    if(!user_range_valid(addr, size))
+        return -1;
 
-    /* 
-     * Then we can map
-     */
-    for(unsigned char* page = addr;
-        page < (unsigned char*)addr + size;
-        page += PAGE_SIZE) {
-
-        /* Then, allocate page and map */
-        uint32_t frame = pmm_alloc();
-        if(frame == INVALID_FRAME) {
-            for(unsigned char* page2 = addr; page2 < page; page2 += PAGE_SIZE) {
-                vmm_unmap(page2);
-            }
-            return 0;
-        }
+    struct address_space* as = current_task->as;
+    mutex_lock(&as->map_lock);
+    vma_unmap(&as->vmas, addr, addr + size);
+    mutex_unlock(&as->map_lock);
 
-        vmm_map(page, frame, vmm_flags);
-    }
+    return 0;
+}
 
-    //trace("mmap(%p, %d, %d)", addr, size, flags);
+/*
+ * mprotect
+ * Params:
+ *  ebx         addr
+ *  ecx         size
+ *  edx         flags, as for mmap
+ * Returns:
+ *  0           Success
+ *  -1          Error, or part of the range is not mapped
+ */
+static uint32_t syscall_mprotect_handler(struct isr_regs* regs)
+{
+    uint32_t addr = regs->ebx;
+    size_t size = (size_t)regs->ecx;
+    uint32_t flags = (uint32_t)regs->edx;
+
+    if(!user_range_valid(addr, size) || flags == 0)
+        return -1;
 
-    return (uint32_t)addr;
+    struct address_space* as = current_task->as;
+    mutex_lock(&as->map_lock);
+    bool result = vma_protect(&as->vmas, addr, addr + size, user_prot_flags(flags));
+    mutex_unlock(&as->map_lock);
+
+    return result ? 0 : -1;
 }
 
 /*
@@ -598,77 +1904,297 @@ static uint32_t syscall_mmap_handler(struct isr_regs* regs)
 static uint32_t syscall_hwportopen_handler(struct isr_regs* regs)
 {
     int port = regs->ebx;
+    if(port < 0 || port >= 65536)
+        return -1;
+
     task_iomap_set(current_task, port, 1);
-    gdt_iomap_set(current_task->iomap, sizeof(current_task->iomap));
+    gdt_iomap_load(current_task->iomap);
+    return 0;
+}
+
+/*
+ * Change the priority of a task
+ * Params:
+ *  ebx         pid
+ *  ecx         new priority
+ * Returns:
+ *  0           Success
+ *  -1          Invalid pid or priority
+ */
+static uint32_t syscall_setpriority_handler(struct isr_regs* regs)
+{
+    int pid = regs->ebx;
+    int priority = regs->ecx;
+
+    if(priority < PRIORITY_HIGHEST || priority > PRIORITY_LOWEST)
+        return (uint32_t)-1;
+
+    struct task* task = task_get(pid);
+    if(!task || task_is_idle(task))
+        return (uint32_t)-1;
+
+    /* Requeue at the new level if it is waiting to run */
+    if(task != current_task && ready_queue_contains(task)) {
+        ready_queue_remove(task);
+        task->priority = priority;
+        ready_queue_push(task);
+    } else {
+        task->priority = priority;
+    }
+
+    return 0;
+}
+
+/*
+ * Move a task to the real-time class, or back to the normal class
+ * Params:
+ *  ebx         pid
+ *  ecx         period in microseconds
+ *  edx         budget in microseconds, 0 to go back to the normal class
+ *  esi         relative deadline in microseconds, 0 for the period
+ * Returns:
+ *  0           Success
+ *  -1          Invalid pid or parameters
+ *  -2          Rejected by admission control: no cpu has enough bandwidth left
+ */
+static uint32_t syscall_setsched_handler(struct isr_regs* regs)
+{
+    int pid = regs->ebx;
+    uint64_t period = regs->ecx * NSEC_PER_USEC;
+    uint64_t budget = regs->edx * NSEC_PER_USEC;
+    uint64_t deadline = (regs->esi ? regs->esi : regs->ecx) * NSEC_PER_USEC;
+
+    struct task* task = task_get(pid);
+    if(!task || task_is_idle(task))
+        return (uint32_t)-1;
+
+    if(!budget) {
+        rt_leave(task);
+        return 0;
+    }
+
+    if(regs->ecx < RT_MIN_PERIOD_US || regs->ecx > RT_MAX_PERIOD_US ||
+       budget > deadline || deadline > period)
+        return (uint32_t)-1;
+
+    /* Rounded up, admission errs on the safe side */
+    uint32_t utilization = (budget * RT_UTIL_ONE + deadline - 1) / deadline;
+
+    /* First fit, starting from the cpu the task is already admitted on */
+    int first = task->rt ? task->rt_cpu : task->cpu;
+    int cpu = -1;
+    for(int i = 0; i < cpu_count() && cpu == -1; i++) {
+        int candidate = (first + i) % cpu_count();
+        uint32_t used = cpu_sched[candidate].rt_utilization;
+        if(task->rt && candidate == task->rt_cpu)
+            used -= task->rt_utilization;
+
+        if(used + utilization <= RT_UTIL_MAX)
+            cpu = candidate;
+    }
+    if(cpu == -1)
+        return (uint32_t)-2;
+
+    rt_leave(task);
+
+    bool queued = task->state == TASK_READY;
+    if(queued)
+        ready_queue_remove(task);
+
+    task->rt = true;
+    task->rt_cpu = cpu;
+    task->rt_period = period;
+    task->rt_relative_deadline = deadline;
+    task->rt_budget = budget;
+    task->rt_utilization = utilization;
+    cpu_sched[cpu].rt_utilization += utilization;
+
+    /* Its first job starts now */
+    uint64_t now = clock_ns();
+    task->rt_release = now;
+    task->rt_deadline = now + deadline;
+    task->rt_runtime = budget;
+    if(task->state == TASK_RUNNING)
+        task->rt_runtime += now - task->state_since;    /* Only charge from now on */
+
+    if(queued)
+        ready_queue_push(task);
+
     return 0;
 }
 
+/*
+ * check2 and check3 for a single task: its pid maps back to it,
+ * and it wasn't already seen during this round of checks
+ */
+static void check_task(struct task* task, unsigned mark)
+{
+    assert(pid_lookup(task->pid) == task);
+    assert(task->check_mark != mark);
+    task->check_mark = mark;
+}
+
+/*
+ * check1 for a single task: not running on, nor idling, any cpu
+ */
+static bool task_is_running(const struct task* task)
+{
+    for(int cpu = 0; cpu < cpu_count(); cpu++) {
+        if(cpu_sched[cpu].current == task || cpu_sched[cpu].idle == task)
+            return true;
+    }
+    return false;
+}
+
 static void scheduler_perform_checks()
 {
-    /* check1: current task and idle task should not be on any queue */
+    /* check1: current tasks and idle tasks should not be on any queue */
     /* check2: no two processes share pids */
     /* check3: tasks should only belong to one queue */
-    uint64_t encountered_pids = 0;
-    list_foreach(task, task, &ready_queue, node) {
-        assert(task != current_task && task != idle_task);
-        assert(!BITTEST(encountered_pids, task->pid));
-        BITSET(encountered_pids, task->pid);
+    /* check4: a level is marked non-empty in the bitmap iff it holds tasks */
+    /* check6: queued tasks are on the run queue of their cpu, nr_ready is in sync */
+    /* check7: queued real-time tasks are on the cpu they were admitted on */
+    static unsigned mark = 0;
+    mark++;
+
+    for(int cpu = 0; cpu < cpu_count(); cpu++) {
+        struct run_queue* rq = &cpu_sched[cpu].ready_queue;
+        unsigned nr_ready = 0;
+
+        for(int level = 0; level < PRIORITY_LEVELS; level++) {
+            assert(list_empty(&rq->levels[level]) == !(rq->bitmap & (1 << level)));
+
+            list_foreach(task, task, &rq->levels[level], node) {
+                assert(!task_is_running(task));
+                assert(task->priority == level);
+                assert(task->state == TASK_READY);
+                assert(task->cpu == cpu);
+                check_task(task, mark);
+                nr_ready++;
+            }
+        }
+
+        assert(nr_ready == rq->nr_ready);
+
+        list_foreach(task, task, &rq->rt_tasks, node) {
+            assert(!task_is_running(task));
+            assert(task->rt && task->rt_cpu == cpu && task->cpu == cpu);
+            assert(task->state == TASK_READY);
+            check_task(task, mark);
+        }
     }
 
     list_foreach(task, task, &sleeping_queue, node) {
-        assert(task != current_task && task != idle_task);
-        assert(!BITTEST(encountered_pids, task->pid));
-        BITSET(encountered_pids, task->pid);
+        assert(!task_is_running(task));
+        assert(task->state == TASK_SLEEPING);
+        check_task(task, mark);
+    }
+
+    /* check5: sleep_heap is ordered and indexes are in sync */
+    for(unsigned i = 0; i < sleep_heap_size; i++) {
+        assert(sleep_heap[i]->sleep_index == i);
+        assert(sleep_heap[i]->state == TASK_SLEEPING);
+        assert(!i || sleep_heap[(i - 1) / 2]->sleep_deadline <= sleep_heap[i]->sleep_deadline);
     }
 
     list_foreach(task, task, &exited_queue, node) {
-        assert(task != current_task && task != idle_task);
-        assert(!BITTEST(encountered_pids, task->pid));
-        BITSET(encountered_pids, task->pid);
+        assert(task != current_task && !task_is_idle(task));
+        assert(task->state == TASK_EXITED);
+        check_task(task, mark);
     }
 }
 
 /*
- * transform current task into an user task
+ * Kernel threads returning from their entry point land here
  */
-void jump_to_usermode(void (*user_entry)())
+static void kthread_exit()
 {
-    struct task* task = current_task;
-
-    task->context.cs = USER_CODE_SEG | RPL3;
-    task->context.ds = task->context.ss = USER_DATA_SEG | RPL3;
-
-    uint32_t frame = pmm_alloc();
-    assert(frame != INVALID_FRAME);
-
-    vmm_map(USER_STACK, frame, VMM_PAGE_PRESENT | VMM_PAGE_WRITABLE | VMM_PAGE_USER);
-    memset(USER_STACK, 0xCC, PAGE_SIZE);
+    syscall(SYSCALL_EXIT, 0, 0, 0, 0, 0);
+}
 
-    task->context.esp = (uint32_t)(USER_STACK + PAGE_SIZE);
+/*
+ * Create a ring0 task running entry(data), with no user mappings
+ */
+static struct task* task_create_kernel(const char* name, void (*entry)(void* data), void* data)
+{
+    struct task* task = task_create(name, address_space_create(vmm_create_pagedir(), 0));
+    struct isr_regs* frame = task_init_stack(task);
+    frame->cs = KERNEL_CODE_SEG;
+    frame->ds = KERNEL_DATA_SEG;
+    frame->eflags = read_eflags() | EFLAGS_IF;
+    frame->eip = (uint32_t)entry;
+
+    /* A ring0 iret pops no stack, entry() finds these as its return address and argument */
+    frame->useresp = (uint32_t)kthread_exit;
+    frame->ss = (uint32_t)data;
+    return task;
+}
 
-    task->context.eflags |= EFLAGS_IF;
-    task->context.eip = (uint32_t)user_entry;
+int kthread_create(const char* name, void (*entry)(void* data), void* data, int priority)
+{
+    assert(!interrupts_enabled());
 
-    switch_context(&task->context);
-    invalid_code_path();
+    struct task* task = task_create_kernel(name, entry, data);
+    task->priority = priority;
+    ready_queue_push(task);
+    return task->pid;
 }
 
-static void idle_task_entry()
+static void idle_task_entry(void* data)
 {
     while(true) {
         hlt();
     }
 }
 
+/*
+ * Create the idle task of a cpu, in the current address space
+ */
+static struct task* idle_task_create(int cpu)
+{
+    struct task* task = task_create_kernel("idle_task", idle_task_entry, NULL);
+    task->cpu = cpu;
+    return task;
+}
+
 void scheduler_start()
 {
+    /* Runs with the kernel lock held from now on, as if entered from an interrupt */
+    kernel_lock();
+
     /* Init global data */
-    list_init(&ready_queue);
+    for(int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        struct run_queue* rq = &cpu_sched[cpu].ready_queue;
+        for(int level = 0; level < PRIORITY_LEVELS; level++)
+            list_init(&rq->levels[level]);
+        rq->bitmap = 0;
+        rq->nr_ready = 0;
+        list_init(&rq->rt_tasks);
+    }
     list_init(&sleeping_queue);
     list_init(&exited_queue);
+    for(int i = 0; i < PORT_WAIT_BUCKETS; i++)
+        list_init(&port_waiters[i]);
+    for(int i = 0; i < FUTEX_WAIT_BUCKETS; i++)
+        list_init(&futex_waiters[i]);
 
-    /* Install scheduler timer */
-    timer_schedule(scheduler_timer, NULL, 50, true);
+    /* 
+     * Install scheduler timers. The sleep timer must run before the scheduler timer
+     * Both are deferrable, the next sleep deadline is given to timer_tickless_enter()
+     */
+    uint32_t timer_id = timer_schedule(sleep_timer, NULL, 0, true);
+    timer_set_deferrable(timer_id, true);
+    timer_id = timer_schedule(scheduler_timer, NULL, SCHEDULER_QUANTUM_MS, true);
+    timer_set_deferrable(timer_id, true);
+
+    /* Lazy FPU switching */
+    idt_install(7, fpu_trap_handler, false);
+
+    /* Application processors are preempted by their local APIC */
+    if(cpu_count() > 1) {
+        idt_install(LAPIC_TIMER_VECTOR, lapic_timer_handler, false);
+        idt_install(IPI_RESCHEDULE, reschedule_ipi_handler, false);
+    }
 
     /* Install syscalls */
     syscall_register(SYSCALL_YIELD, syscall_yield_handler);
@@ -677,40 +2203,47 @@ void scheduler_start()
     syscall_register(SYSCALL_SLEEP, syscall_sleep_handler);
     syscall_register(SYSCALL_EXEC, syscall_exec_handler);
     syscall_register(SYSCALL_MMAP, syscall_mmap_handler);
+    syscall_register(SYSCALL_MUNMAP, syscall_munmap_handler);
+    syscall_register(SYSCALL_MPROTECT, syscall_mprotect_handler);
     syscall_register(SYSCALL_BLOCK, syscall_block_handler);
     syscall_register(SYSCALL_HWPORTOPEN, syscall_hwportopen_handler);
+    syscall_register(SYSCALL_SETPRIORITY, syscall_setpriority_handler);
+    syscall_register(SYSCALL_SETSCHED, syscall_setsched_handler);
+    syscall_register(SYSCALL_SPAWN, syscall_spawn_handler);
+    syscall_register(SYSCALL_THREAD_CREATE, syscall_thread_create_handler);
+    syscall_register(SYSCALL_THREAD_EXIT, syscall_thread_exit_handler);
+    syscall_register(SYSCALL_FUTEX_WAIT, syscall_futex_wait_handler);
+    syscall_register(SYSCALL_FUTEX_WAKE, syscall_futex_wake_handler);
+
+    /* Create first task (init) */
+    struct task* task = task_create_kernel("kernel_task", kernel_task_entry, NULL);
+    task->priority = PRIORITY_SERVER;
 
-    /* Map kernel stack */ 
-    uint32_t stack_frame = pmm_alloc();
-    assert(stack_frame != INVALID_FRAME);
+    /* Create one idle_task per cpu */
+    for(int cpu = 0; cpu < cpu_count(); cpu++) {
+        cpu_sched[cpu].idle = idle_task_create(cpu);
+        cpu_sched[cpu].current = cpu_sched[cpu].idle;
+    }
 
-    vmm_map(KERNEL_STACK, stack_frame, VMM_PAGE_PRESENT | VMM_PAGE_WRITABLE);
-    memset(KERNEL_STACK, 0xCC, PAGE_SIZE);
+    /* Bottom halves, e.g. collecting exited tasks */
+    work_init(&collect_work, collect_exited_tasks, NULL);
+    workqueue_init();
 
-    tss_set_kernel_stack(KERNEL_STACK + PAGE_SIZE);
+    /* Other cpus wait on the kernel lock until we switch to the first task */
+    smp_release_aps();
 
-    /* Create first task (init) */
-    struct task* task = task_create("kernel_task");
-    task->context.cs = KERNEL_CODE_SEG;
-    task->context.ds = KERNEL_DATA_SEG;
-    task->context.ss = KERNEL_DATA_SEG;
-    task->context.cr3 = vmm_get_physical(task->pagedir);
-    task->context.esp = (uint32_t)(KERNEL_STACK + PAGE_SIZE);
-    task->context.eflags = read_eflags() | EFLAGS_IF;
-    task->context.eip = (uint32_t)kernel_task_entry;
-
-    /* Create idle_task */
-    struct task* task1 = task_create("idle_task");
-    task1->context.cs = KERNEL_CODE_SEG;
-    task1->context.ds = task1->context.ss = KERNEL_DATA_SEG;
-    task1->context.cr3 = vmm_get_physical(task1->pagedir);
-    task1->context.esp = (uint32_t)(KERNEL_STACK + PAGE_SIZE);
-    task1->context.eflags = read_eflags() | EFLAGS_IF;
-    task1->context.eip = (uint32_t)idle_task_entry;
-    idle_task = task1;
-
-    /* Switch to first task */
-    task_switch(task);
+    /* Switch to first task, the boot stack is left for good */
+    current_task = NULL;
+    task_switch(task, true);
+    invalid_code_path();
+}
+
+void scheduler_start_ap()
+{
+    kernel_lock();
+
+    current_task = NULL;
+    task_switch(idle_task, true);
     invalid_code_path();
 }
 
@@ -4,6 +4,7 @@
 #include "list.h"
 #include "context.h"
 #include "idt.h"
+#include "thread.h"
 
 #include <stdint.h>
 
@@ -12,19 +13,17 @@
  * Address-space layout for each task
  *
  *  ---------------------------------------------   0x00000000
- *   process-specific user space
- *  ---------------------------------------------
- *   free address space
- *  ---------------------------------------------   0xBFFFC000
- *   process-specific user stack
- *  ---------------------------------------------   0xBFFFD000
- *   guard page
- *  ---------------------------------------------   0xBFFFE000
- *   process-specific kernel stack
- *  ---------------------------------------------   0xBFFFF000
- *   guard page
- *  ---------------------------------------------   0xC0000000
- *   shared high kernel space
+ *   unmapped
+ *  ---------------------------------------------   USER_START
+ *   image, heap and mmap() regions, see vma.h
+ *  ---------------------------------------------   THREAD_STACK_TOP(MAX_THREADS)
+ *   user stack slots of the threads, the main
+ *   thread in the topmost one, see thread.h
+ *  ---------------------------------------------   THREAD_STACKS_TOP
+ *   unmapped
+ *  ---------------------------------------------   KERNEL_BASE_ADDR
+ *   shared high kernel space, holding the
+ *   kernel stacks of the tasks (KERNEL_STACK_SIZE)
  *  ---------------------------------------------   0xFFFFFFFF
  *
  *
@@ -33,6 +32,7 @@
  *  - Sleeping until condition is met:
  *      - Deadline
  *      - Wait for port to accept messages
+ *      - Wait for a futex_wake() on a user address
  *      - Wait for message to be available on port
  *  - Exited
  *
@@ -43,23 +43,48 @@
  * 
  */
 
-#define USER_STACK          ((unsigned char*)0xBFFFC000)
-#define KERNEL_STACK        ((unsigned char*)0xBFFFE000)
+#define USER_STACK          ((unsigned char*)(THREAD_STACKS_TOP - PAGE_SIZE))  /* Main thread */
+#define KERNEL_STACK_SIZE   PAGE_SIZE       /* Per task, in the kernel heap */
 
 #define TASK_NAME_MAX       32
+#define SPAWN_ARGS_MAX      256             /* Longer argument strings are truncated */
 #define INVALID_PID         (-1)
 #define SLEEP_INFINITE      0xFFFFFFFF
 
 /*
- * Save current task state
- * Should only be called from syscall_handler()
+ * Put current task into sleeping queue
+ * timeout_us is in microseconds, or SLEEP_INFINITE
  */
-void save_current_task_state(const struct isr_regs* regs);
+void task_block(int canrecv_port, int cansend_port, unsigned timeout_us);
 
 /*
- * Put current task into sleeping queue
+ * Same as task_wake(pid) followed by task_block(), except that if pid was
+ * sleeping, it runs right away on the rest of the current time slice
+ */
+void task_handoff_block(int pid, int canrecv_port, int cansend_port, unsigned timeout_us);
+
+/*
+ * Not-present page fault on address, in ring3 or in the kernel accessing user memory
+ * Returns true if it was populated from a region of the current address space
+ */
+bool task_resolve_fault(void* address);
+
+/*
+ * Copy from/to the user memory of the current task, from a syscall
+ * Returns false, without touching it, unless all of it is mapped
+ * (and writable, for copy_to_user)
  */
-void task_block(int canrecv_port, int cansend_port, unsigned timeout);
+bool task_copy_from_user(void* dst, const void* src, size_t size);
+bool task_copy_to_user(void* dst, const void* src, size_t size);
+bool task_copy_string_from_user(char* dst, const char* src, size_t size);   /* Truncated like strlcpy() */
+
+/*
+ * Kernel wait queues, keyed by a kernel address
+ * task_block_on() sleeps until task_wake_on() on the same address
+ * Returns the number of tasks woken
+ */
+void task_block_on(const void* addr);
+unsigned task_wake_on(const void* addr, unsigned count);
 
 /*
  * Remove task from sleeping queue and put into ready queue
@@ -80,9 +105,52 @@ int current_task_pid();
 struct task_info;
 bool get_task_info(struct task_info* buffer, int pid);
 
-void jump_to_usermode(void (*user_entry)());
+/*
+ * Scheduler stats of the live task with the lowest pid >= pid
+ * Returns false if there is none
+ */
+struct task_stats;
+bool get_task_stats(struct task_stats* buffer, int pid);
+
+/*
+ * Start a process from an initrd image, in a new address space
+ * args is handed to its runtime, it can be NULL
+ * Returns its pid, or INVALID_PID
+ */
+int task_spawn(const char* filename, const char* args);
 
 void scheduler_start();
 
+/*
+ * Start a kernel thread running entry(data) in ring0, with interrupts enabled
+ * and without the kernel lock. Returning from entry() exits it
+ * Returns its pid
+ */
+int kthread_create(const char* name, void (*entry)(void* data), void* data, int priority);
+
+/*
+ * Voluntary preemption point for long loops of syscalls
+ * Takes pending interrupts, lets the other cpus into the kernel and switches
+ * tasks if asked to. Does nothing inside critical sections or nested syscalls.
+ * Callers must not rely on kernel state they do not own staying the same across it
+ */
+void task_preempt_point();
+
+/*
+ * Flush the TLB of the other cpus running a task in the address space of
+ * the current task. Before releasing the kernel lock, once its user
+ * mappings were changed
+ */
+void task_flush_tlb_others();
+
+/*
+ * Called by isr_handler() before leaving the kernel
+ * Performs the preemption interrupt handlers asked for
+ */
+void scheduler_isr_return();
+
+/* Entry point of application processors into the scheduler */
+void scheduler_start_ap();
+
 
 
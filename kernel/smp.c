@@ -0,0 +1,507 @@
+#include "smp.h"
+#include "gdt.h"
+#include "idt.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "kmalloc.h"
+#include "clock.h"
+#include "fpu.h"
+#include "scheduler.h"
+#include "registers.h"
+#include "locks.h"
+#include "string.h"
+#include "kernel.h"
+#include "debug.h"
+#include "util.h"
+#include "lock_stats.h"
+
+/************************************************************************************
+ * MP configuration table (Intel MultiProcessor Specification 1.4)
+ ************************************************************************************/
+struct mp_floating {
+    char signature[4];              /* "_MP_" */
+    uint32_t config;                /* Physical address of struct mp_config */
+    uint8_t length;                 /* In 16 bytes units */
+    uint8_t spec_rev;
+    uint8_t checksum;
+    uint8_t features[5];            /* features[0] != 0: default configuration, no table */
+} __attribute__((packed));
+
+struct mp_config {
+    char signature[4];              /* "PCMP" */
+    uint16_t length;
+    uint8_t spec_rev;
+    uint8_t checksum;
+    char oem[8];
+    char product[12];
+    uint32_t oem_table;
+    uint16_t oem_table_size;
+    uint16_t entry_count;
+    uint32_t lapic;                 /* Physical address of local APICs */
+    uint16_t ext_length;
+    uint8_t ext_checksum;
+    uint8_t reserved;
+} __attribute__((packed));
+
+struct mp_processor {
+    uint8_t type;                   /* MP_ENTRY_PROCESSOR */
+    uint8_t lapic_id;
+    uint8_t lapic_version;
+    uint8_t flags;
+    uint32_t signature;
+    uint32_t features;
+    uint32_t reserved[2];
+} __attribute__((packed));
+
+#define MP_ENTRY_PROCESSOR      0
+#define MP_ENTRY_SIZE           8       /* Size of every other entry type */
+#define MP_PROCESSOR_ENABLED    0x01
+#define MP_PROCESSOR_BSP        0x02
+
+/************************************************************************************
+ * Local APIC
+ ************************************************************************************/
+#define LAPIC                   ((volatile uint8_t*)0xFFBFF000)
+#define LAPIC_ID                0x020
+#define LAPIC_EOI               0x0B0
+#define LAPIC_SVR               0x0F0
+#define LAPIC_ICR_LOW           0x300
+#define LAPIC_ICR_HIGH          0x310
+#define LAPIC_LVT_TIMER         0x320
+#define LAPIC_LVT_LINT0         0x350
+#define LAPIC_LVT_LINT1         0x360
+#define LAPIC_TIMER_INIT        0x380
+#define LAPIC_TIMER_CURRENT     0x390
+#define LAPIC_TIMER_DIVIDE      0x3E0
+
+#define SVR_ENABLE              0x100
+#define LVT_MASKED              0x10000
+#define LVT_EXTINT              0x700
+#define LVT_NMI                 0x400
+#define ICR_INIT                0x500
+#define ICR_STARTUP             0x600
+#define ICR_PENDING             0x1000
+#define ICR_ASSERT              0x4000
+#define TIMER_DIVIDE_16         0x3
+
+/************************************************************************************
+ * AP trampoline (smp_trampoline.asm)
+ ************************************************************************************/
+#define TRAMPOLINE_PA           0x8000
+#define TRAMPOLINE              ((unsigned char*)TRAMPOLINE_PA)     /* Identity mapped while booting APs */
+
+extern unsigned char ap_trampoline[];
+extern unsigned char ap_trampoline_end[];
+extern uint32_t ap_trampoline_cr3;
+extern uint32_t ap_trampoline_stack;
+extern uint32_t ap_trampoline_entry;
+
+struct cpu {
+    uint8_t apic_id;
+    volatile bool online;
+};
+
+static struct cpu cpus[MAX_CPUS] = {0};
+static int cpus_found = 1;                  /* cpu 0 is the BSP, even without MP table */
+static int cpus_online = 1;
+static uint32_t lapic_pa = 0;
+static uint32_t lapic_ticks_per_ms = 0;
+static volatile int ap_booting = -1;
+static volatile bool aps_released = false;
+static volatile uint32_t tlb_flush_pending = 0;     /* Bit n set until cpu n flushed its TLB */
+
+static void tlb_flush_poll();
+
+/************************************************************************************
+ * Big kernel lock
+ ************************************************************************************/
+static struct {
+    spinlock_t lock;
+    volatile int owner;             /* cpu holding the lock, -1 if none */
+    unsigned depth;
+} bkl = { SPINLOCK_INIT, -1, 0 };
+
+/*
+ * Do not assert/trace in kernel_lock() and kernel_unlock(),
+ * logging takes the lock itself
+ */
+void kernel_lock()
+{
+    int cpu = cpu_id();
+    if(bkl.owner == cpu) {
+        bkl.depth++;
+        return;
+    }
+
+    /* The holder may be waiting for us to flush our TLB */
+    spin_lock_poll(&bkl.lock, tlb_flush_poll);
+
+    bkl.owner = cpu;
+    bkl.depth = 1;
+}
+
+void kernel_unlock()
+{
+    if(--bkl.depth == 0) {
+        bkl.owner = -1;
+        spin_unlock(&bkl.lock);
+    }
+}
+
+unsigned kernel_lock_depth()
+{
+    assert(bkl.owner == cpu_id());
+    return bkl.depth;
+}
+
+/*
+ * Called by a task resumed on this cpu, right off switch_context()
+ * The lock stays held across the switch, the resumed task takes it
+ * over with the depth it was switched out with
+ */
+void kernel_lock_resume(unsigned depth)
+{
+    assert(bkl.owner == cpu_id());
+    assert(depth);
+
+    bkl.depth = depth;
+}
+
+/************************************************************************************
+ * TLB shootdown
+ ************************************************************************************/
+
+/*
+ * Run while waiting for the kernel lock, with interrupts disabled:
+ * the cpu holding it sent the shootdown and waits for our flush
+ */
+static void tlb_flush_poll()
+{
+    uint32_t bit = 1 << cpu_id();
+    if(tlb_flush_pending & bit) {
+        write_cr3(read_cr3());
+        __sync_fetch_and_and(&tlb_flush_pending, ~bit);
+    }
+}
+
+/* Only gets a cpu out of user mode, it flushed while taking the kernel lock */
+static void tlb_shootdown_handler(struct isr_regs* regs)
+{
+    lapic_eoi();
+}
+
+void smp_tlb_shootdown(uint32_t mask)
+{
+    assert(bkl.owner == cpu_id());
+
+    mask &= ~(1 << cpu_id());
+    if(!mask)
+        return;
+
+    __sync_fetch_and_or(&tlb_flush_pending, mask);
+    for(int cpu = 0; cpu < cpus_online; cpu++) {
+        if(mask & (1 << cpu))
+            lapic_send_ipi(cpu, IPI_TLB_SHOOTDOWN);
+    }
+
+    while(tlb_flush_pending & mask)
+        cpu_relax();
+}
+
+/************************************************************************************
+ * MP table parsing
+ ************************************************************************************/
+
+/* Low physical memory, only valid before vmm_init() */
+static void* early_phys(uint32_t pa)
+{
+    assert(pa < 0x400000);
+    return (void*)(KERNEL_BASE_ADDR + pa);
+}
+
+static uint8_t checksum(const void* data, size_t size)
+{
+    const uint8_t* p = data;
+    uint8_t sum = 0;
+    for(size_t i = 0; i < size; i++)
+        sum += p[i];
+    return sum;
+}
+
+static struct mp_floating* mp_scan(uint32_t start, uint32_t size)
+{
+    for(uint32_t pa = start; pa + sizeof(struct mp_floating) <= start + size; pa += 16) {
+        struct mp_floating* mpf = early_phys(pa);
+        if(!memcmp(mpf->signature, "_MP_", 4) && !checksum(mpf, mpf->length * 16))
+            return mpf;
+    }
+    return NULL;
+}
+
+static struct mp_floating* mp_find()
+{
+    /* First KB of the EBDA, last KB of base memory, then BIOS ROM */
+    uint32_t ebda = *(uint16_t*)early_phys(0x40E) << 4;
+    uint32_t basemem = (*(uint16_t*)early_phys(0x413)) * 1024;
+
+    struct mp_floating* mpf = NULL;
+    if(ebda)
+        mpf = mp_scan(ebda, 1024);
+    if(!mpf && basemem)
+        mpf = mp_scan(basemem - 1024, 1024);
+    if(!mpf)
+        mpf = mp_scan(0xF0000, 0x10000);
+    return mpf;
+}
+
+void smp_init()
+{
+    cpus[BSP_CPU].online = true;
+    lock_stats_register(&bkl.lock.stats, "kernel_lock");
+
+    struct mp_floating* mpf = mp_find();
+    if(!mpf || mpf->features[0] || !mpf->config || mpf->config >= 0x400000) {
+        trace("No MP configuration table");
+        return;
+    }
+
+    struct mp_config* config = early_phys(mpf->config);
+    if(memcmp(config->signature, "PCMP", 4) || checksum(config, config->length)) {
+        trace("Invalid MP configuration table");
+        return;
+    }
+
+    lapic_pa = config->lapic;
+
+    unsigned char* entry = (unsigned char*)(config + 1);
+    for(unsigned i = 0; i < config->entry_count; i++) {
+        if(*entry != MP_ENTRY_PROCESSOR) {
+            entry += MP_ENTRY_SIZE;
+            continue;
+        }
+
+        struct mp_processor* processor = (struct mp_processor*)entry;
+        entry += sizeof(struct mp_processor);
+
+        if(!(processor->flags & MP_PROCESSOR_ENABLED))
+            continue;
+
+        if(processor->flags & MP_PROCESSOR_BSP) {
+            cpus[BSP_CPU].apic_id = processor->lapic_id;
+        } else if(cpus_found < MAX_CPUS) {
+            cpus[cpus_found++].apic_id = processor->lapic_id;
+        } else {
+            trace("Ignoring cpu with APIC id %d, MAX_CPUS reached", processor->lapic_id);
+        }
+    }
+
+    /* Keep the trampoline frame away from the pmm */
+    if(cpus_found > 1 && pmm_exists(TRAMPOLINE_PA) && !pmm_reserved(TRAMPOLINE_PA))
+        pmm_reserve(TRAMPOLINE_PA);
+
+    trace("MP table: %d cpus, local APIC at %p", cpus_found, lapic_pa);
+}
+
+/************************************************************************************
+ * Local APIC
+ ************************************************************************************/
+static uint32_t lapic_read(unsigned reg)
+{
+    return *(volatile uint32_t*)(LAPIC + reg);
+}
+
+static void lapic_write(unsigned reg, uint32_t value)
+{
+    *(volatile uint32_t*)(LAPIC + reg) = value;
+}
+
+static void delay_us(uint64_t us)
+{
+    uint64_t end = clock_ns() + us * NSEC_PER_USEC;
+    while(clock_ns() < end)
+        cpu_relax();
+}
+
+static void lapic_spurious_handler(struct isr_regs* regs)
+{
+    /* No EOI for spurious interrupts */
+}
+
+static void lapic_init()
+{
+    lapic_write(LAPIC_SVR, SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+    lapic_write(LAPIC_TIMER_DIVIDE, TIMER_DIVIDE_16);
+
+    if(cpu_id() == BSP_CPU) {
+        /* Virtual wire mode: PIC interrupts keep going to the BSP */
+        lapic_write(LAPIC_LVT_LINT0, LVT_EXTINT);
+        lapic_write(LAPIC_LVT_LINT1, LVT_NMI);
+    } else {
+        lapic_write(LAPIC_LVT_LINT0, LVT_MASKED);
+        lapic_write(LAPIC_LVT_LINT1, LVT_MASKED);
+    }
+
+    lapic_eoi();
+}
+
+/*
+ * Local APIC timers all run from the same bus clock,
+ * measure it once against the clocksource
+ */
+static void lapic_timer_calibrate()
+{
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    delay_us(10 * 1000);
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+
+    lapic_ticks_per_ms = elapsed / 10;
+    assert(lapic_ticks_per_ms);
+}
+
+void lapic_eoi()
+{
+    lapic_write(LAPIC_EOI, 0);
+}
+
+static void lapic_send(uint8_t apic_id, uint32_t command)
+{
+    while(lapic_read(LAPIC_ICR_LOW) & ICR_PENDING)
+        cpu_relax();
+
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, command);
+}
+
+void lapic_send_ipi(int cpu, int vector)
+{
+    assert(cpu >= 0 && cpu < cpus_found && cpus[cpu].online);
+    lapic_send(cpus[cpu].apic_id, vector);
+}
+
+void lapic_timer_oneshot(uint32_t ms)
+{
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INIT, ms * lapic_ticks_per_ms);
+}
+
+void lapic_timer_stop()
+{
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+}
+
+/************************************************************************************
+ * AP bring-up
+ ************************************************************************************/
+
+/*
+ * First C code run by application processors, on the boot stack
+ * allocated by smp_start(), with the kernel pagedir
+ */
+static void ap_main()
+{
+    int cpu = ap_booting;
+
+    gdt_init_cpu(cpu);
+    idt_flush();
+    vmm_init_cpu();
+    fpu_init();
+    lapic_init();
+
+    cpus[cpu].online = true;
+
+    while(!aps_released)
+        cpu_relax();
+
+    scheduler_start_ap();
+    invalid_code_path();
+}
+
+static bool ap_start(int cpu)
+{
+    void* stack = kmalloc(PAGE_SIZE);
+    *(uint32_t*)(TRAMPOLINE + ((unsigned char*)&ap_trampoline_stack - ap_trampoline)) = (uint32_t)stack + PAGE_SIZE;
+    ap_booting = cpu;
+
+    /* INIT, then STARTUP twice, as per the MP specification */
+    uint8_t apic_id = cpus[cpu].apic_id;
+    lapic_send(apic_id, ICR_INIT | ICR_ASSERT);
+    delay_us(10 * 1000);
+    for(int i = 0; i < 2 && !cpus[cpu].online; i++) {
+        lapic_send(apic_id, ICR_STARTUP | (TRAMPOLINE_PA >> 12));
+        delay_us(200);
+    }
+
+    uint64_t timeout = clock_ns() + 100 * NSEC_PER_MSEC;
+    while(!cpus[cpu].online && clock_ns() < timeout)
+        cpu_relax();
+
+    if(!cpus[cpu].online) {
+        /*
+         * Back to waiting for a STARTUP that never comes: a late start would
+         * run on a slot and a trampoline we are about to reuse
+         */
+        lapic_send(apic_id, ICR_INIT | ICR_ASSERT);
+        delay_us(10 * 1000);
+        cpus[cpu].online = false;
+
+        /* The stack is leaked on purpose, the AP may have run on it before the INIT */
+        trace("cpu %d (APIC id %d) did not start", cpu, apic_id);
+        return false;
+    }
+    return true;
+}
+
+void smp_start()
+{
+    if(cpus_found == 1) {
+        trace("Uniprocessor system");
+        return;
+    }
+
+    vmm_map((void*)LAPIC, lapic_pa, VMM_PAGE_PRESENT | VMM_PAGE_WRITABLE | VMM_PAGE_NOCACHE);
+    idt_install(LAPIC_SPURIOUS_VECTOR, lapic_spurious_handler, false);
+    idt_install(IPI_TLB_SHOOTDOWN, tlb_shootdown_handler, false);
+    lapic_init();
+    lapic_timer_calibrate();
+
+    /* The trampoline enables paging while running from low memory */
+    vmm_map(TRAMPOLINE, TRAMPOLINE_PA, VMM_PAGE_PRESENT | VMM_PAGE_WRITABLE);
+    memcpy(TRAMPOLINE, ap_trampoline, ap_trampoline_end - ap_trampoline);
+    *(uint32_t*)(TRAMPOLINE + ((unsigned char*)&ap_trampoline_cr3 - ap_trampoline)) = read_cr3();
+    *(uint32_t*)(TRAMPOLINE + ((unsigned char*)&ap_trampoline_entry - ap_trampoline)) = (uint32_t)ap_main;
+
+    /* 
+     * Boot one at a time, they share the trampoline
+     * cpu ids stay contiguous, a cpu which fails to start is put back into
+     * INIT by ap_start() and gives its slot to the next one. Once the loop
+     * is done, every AP either reported in or is halted for good
+     */
+    for(int i = 1; i < cpus_found; i++) {
+        int cpu = cpus_online;
+        cpus[cpu].apic_id = cpus[i].apic_id;
+        if(ap_start(cpu))
+            cpus_online++;
+    }
+
+    vmm_unmap(TRAMPOLINE);
+
+    trace("%d cpus online", cpus_online);
+}
+
+void smp_release_aps()
+{
+    aps_released = true;
+}
+
+int cpu_id()
+{
+    return gdt_cpu();
+}
+
+int cpu_count()
+{
+    return cpus_online;
+}
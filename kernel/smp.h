@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "spinlock.h"
+
+/*
+ * Symmetric multiprocessing
+ *
+ * Processors are discovered through the Intel MP configuration table.
+ * cpu 0 is always the bootstrap processor, application processors are
+ * numbered from 1 in table order.
+ *
+ * Kernel code is serialized by a single big kernel lock. It is taken on
+ * every interrupt/syscall entry and by enter_critical_section(), and is
+ * recursive for the cpu holding it. Task switches hand the lock over to
+ * the resumed task (see kernel_lock_resume()).
+ *
+ * Page table changes are made with the kernel lock held, so every other
+ * cpu is either outside the kernel or waiting for the lock. A TLB shootdown
+ * IPI brings the former to the latter, and cpus waiting for the lock
+ * flush their TLB when asked, see smp_tlb_shootdown().
+ */
+#define MAX_CPUS                8
+#define BSP_CPU                 0
+
+/* Local APIC interrupt vectors */
+#define IPI_RESCHEDULE          0x40
+#define LAPIC_TIMER_VECTOR      0x41
+#define IPI_TLB_SHOOTDOWN       0x42
+#define LAPIC_SPURIOUS_VECTOR   0xFF
+
+static inline void cpu_relax()
+{
+    asm volatile ( "pause" ::: "memory" );
+}
+
+void smp_init();                    /* Before vmm_init(): parse the MP table */
+void smp_start();                   /* After timer_init(): boot application processors */
+void smp_release_aps();             /* Let application processors enter the scheduler */
+
+int cpu_id();
+int cpu_count();                    /* Number of online cpus */
+
+/* Local APIC of the current cpu. Only valid when cpu_count() > 1 */
+void lapic_eoi();
+void lapic_send_ipi(int cpu, int vector);
+void lapic_timer_oneshot(uint32_t ms);
+void lapic_timer_stop();
+
+/*
+ * Flush the TLB of the cpus of mask but the current one, and wait until
+ * they all did. With the kernel lock held
+ */
+void smp_tlb_shootdown(uint32_t mask);
+
+unsigned kernel_lock_depth();
+void kernel_lock_resume(unsigned depth);
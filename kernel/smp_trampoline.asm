@@ -0,0 +1,75 @@
+;
+; Application processor trampoline
+; Copied to TRAMPOLINE_PA (0x8000) by smp_start(). APs start here in
+; real mode after the STARTUP IPI, switch to protected mode, enable
+; paging with the kernel pagedir and call ap_main() on their boot stack
+;
+
+TRAMPOLINE_PA   equ 0x8000
+
+; Address of a trampoline label once copied to TRAMPOLINE_PA
+%define REL(x) ((x) - ap_trampoline + TRAMPOLINE_PA)
+
+section .text
+
+bits 16
+global ap_trampoline
+ap_trampoline:
+    cli
+    cld
+
+    xor     ax, ax
+    mov     ds, ax
+    lgdt    [REL(tramp_gdt_ptr)]
+
+    mov     eax, cr0
+    or      eax, 0x1                            ; PE
+    mov     cr0, eax
+    jmp     dword 0x08:REL(.protected_mode)
+
+bits 32
+.protected_mode:
+    mov     ax, 0x10
+    mov     ds, ax
+    mov     es, ax
+    mov     fs, ax
+    mov     gs, ax
+    mov     ss, ax
+
+    mov     eax, [REL(ap_trampoline_cr3)]
+    mov     cr3, eax
+
+    mov     eax, cr0
+    or      eax, 0x80010000                     ; PG | WP
+    mov     cr0, eax
+
+    mov     esp, [REL(ap_trampoline_stack)]
+    mov     eax, [REL(ap_trampoline_entry)]
+    call    eax
+
+.halt:
+    cli
+    hlt
+    jmp     .halt
+
+; Flat code and data segments, same selectors as the kernel GDT
+align 8
+tramp_gdt:
+    dq      0x0000000000000000
+    dq      0x00CF9A000000FFFF                  ; 0x08: code
+    dq      0x00CF92000000FFFF                  ; 0x10: data
+tramp_gdt_ptr:
+    dw      tramp_gdt_ptr - tramp_gdt - 1
+    dd      REL(tramp_gdt)
+
+; Parameters, filled in by smp_start()
+align 4
+global ap_trampoline_cr3
+ap_trampoline_cr3:      dd 0
+global ap_trampoline_stack
+ap_trampoline_stack:    dd 0
+global ap_trampoline_entry
+ap_trampoline_entry:    dd 0
+
+global ap_trampoline_end
+ap_trampoline_end:
@@ -31,7 +31,6 @@ static void syscall_handler(struct isr_regs* regs)
               current_task_name());
 #endif
 
-        save_current_task_state(regs);
         kernel_heap_check();
         regs->eax = handler(regs);
         kernel_heap_check();
@@ -5,14 +5,22 @@
 #include "debug.h"
 #include "kernel.h"
 #include "locks.h"
+#include "registers.h"
+#include "clock.h"
 
 #define PORT_COMMAND    0x43
 #define PORT_DATA       0x40
-#define ICW             0x36
+#define ICW             0x34            /* Channel 0, lobyte/hibyte, mode 2 (rate generator) */
+#define ICW_ONESHOT     0x30            /* Channel 0, lobyte/hibyte, mode 0 (interrupt on terminal count) */
+#define READBACK        0xC2            /* Read-back status and count of channel 0 */
+#define STATUS_OUT      0x80            /* Output pin high: one-shot count expired */
+#define STATUS_NULL     0x40            /* Count written but not loaded yet */
 #define INTERNAL_FREQ   1193180
 #define FREQ            100              /* HZ */
 #define TICKS_PER_MS    (1000 / FREQ)
+#define PERIODIC_COUNT  (INTERNAL_FREQ / FREQ)
 #define MAX_TIMERS      10
+#define TICKLESS_MAX_MS 50              /* Must fit a 16 bit count (~54ms) */
 
 struct timer_info {
     uint32_t id;
@@ -20,6 +28,7 @@ struct timer_info {
     void* callback_data;
     uint32_t period;                    /* milliseconds */
     bool recurring;
+    bool deferrable;                    /* Does not prevent tickless mode */
     uint64_t last_triggered;
 };
 
@@ -29,10 +38,108 @@ static struct timer_info timers[MAX_TIMERS] = {0};
 static int timer_count = 0;
 static int next_timer_id = 0;
 
+/*
+ * Tickless mode
+ * While tickless, the PIT runs a single one-shot count instead of the
+ * periodic tick. Elapsed PIT counts are converted to milliseconds, the
+ * sub-millisecond remainder is carried over to the next period
+ */
+static bool tickless = false;
+static bool stale_irq = false;          /* One-shot expired before tickless exit */
+static uint32_t oneshot_count = 0;
+static uint32_t pending_count = 0;
+static uint64_t ticks_avoided = 0;
+
+static void program_periodic()
+{
+    outb(PORT_COMMAND, ICW);
+    outb(PORT_DATA, LOBYTE(PERIODIC_COUNT));
+    outb(PORT_DATA, HIBYTE(PERIODIC_COUNT));
+}
+
+static void program_oneshot(uint32_t count)
+{
+    assert(count > 0 && count <= 0xFFFF);
+
+    outb(PORT_COMMAND, ICW_ONESHOT);
+    outb(PORT_DATA, LOBYTE(count));
+    outb(PORT_DATA, HIBYTE(count));
+}
+
+/*
+ * Account `count` PIT counts spent in tickless mode, during
+ * which `irqs` timer interrupts were raised
+ */
+static void tickless_account(uint32_t count, uint32_t irqs)
+{
+    pending_count += count;
+
+    uint32_t elapsed = (uint64_t)pending_count * 1000 / INTERNAL_FREQ;
+    pending_count -= (uint64_t)elapsed * INTERNAL_FREQ / 1000;
+    current_timestamp += elapsed;
+
+    uint32_t periodic_ticks = elapsed / TICKS_PER_MS;
+    if(periodic_ticks > irqs)
+        ticks_avoided += periodic_ticks - irqs;
+}
+
+/*
+ * Latch and read channel 0 status and current count
+ */
+static uint8_t pit_readback(uint32_t* count)
+{
+    outb(PORT_COMMAND, READBACK);
+    uint8_t status = inb(PORT_DATA);
+    uint8_t lo = inb(PORT_DATA);
+    uint8_t hi = inb(PORT_DATA);
+
+    *count = (hi << 8) | lo;
+    return status;
+}
+
+/*
+ * Stop the one-shot count before it expired and account the time
+ * elapsed so far. Leaves the PIT stopped
+ */
+static void tickless_stop()
+{
+    assert(tickless);
+
+    uint32_t remaining;
+    uint8_t status = pit_readback(&remaining);
+
+    if(status & STATUS_OUT) {
+        /* Expired, its irq is pending and must not advance the time again */
+        tickless_account(oneshot_count, 1);
+        stale_irq = true;
+    } else if(status & STATUS_NULL) {
+        /* Not even started */
+    } else {
+        assert(remaining <= oneshot_count);
+        tickless_account(oneshot_count - remaining, 0);
+    }
+
+    tickless = false;
+}
+
 static void irq_handler(int irq, const struct isr_regs* regs)
 {
     ticks++;
-    current_timestamp += TICKS_PER_MS;
+
+    uint32_t remaining;
+    if(tickless && (pit_readback(&remaining) & STATUS_OUT)) {
+        /* One-shot expired, back to periodic until the scheduler decides otherwise */
+        tickless = false;
+        stale_irq = false;
+        program_periodic();
+        tickless_account(oneshot_count, 1);
+    } else if(stale_irq) {
+        /* Time already accounted by tickless_stop() */
+        stale_irq = false;
+    } else {
+        /* Periodic tick, possibly raised just before the one-shot was programmed */
+        current_timestamp += TICKS_PER_MS;
+    }
 
     // trace("Ticks: %d, Timestamp: %d", (uint32_t)ticks, (uint32_t)current_timestamp);
 
@@ -54,12 +161,7 @@ static void irq_handler(int irq, const struct isr_regs* regs)
 
 void timer_init()
 {
-    uint32_t divisor = INTERNAL_FREQ / FREQ;
-
-    outb(PORT_COMMAND, ICW);
-    outb(PORT_DATA, LOBYTE(divisor));
-    outb(PORT_DATA, HIBYTE(divisor));
-
+    program_periodic();
     pic_install(IRQ_TIMER, irq_handler);
 }
 
@@ -73,18 +175,91 @@ uint64_t timer_ticks()
     return ticks;
 }
 
+uint64_t timer_ticks_avoided()
+{
+    return ticks_avoided;
+}
+
+/*
+ * Program the timer for the next deadline instead of the periodic tick
+ * Params:
+ *  deadline    clock_ns() timestamp of the next event known by the caller, 0 if none
+ * The earliest non-deferrable timer is taken into account as well.
+ * Called with interrupts disabled, when no task is waiting for a quantum
+ */
+void timer_tickless_enter(uint64_t deadline)
+{
+    assert(!interrupts_enabled());
+
+    if(tickless) {
+        tickless_stop();
+    } else {
+        /* Account the part of the current period which already elapsed */
+        uint32_t remaining;
+        if(!(pit_readback(&remaining) & STATUS_NULL))
+            tickless_account(PERIODIC_COUNT - remaining, 0);
+    }
+
+    uint64_t delay = TICKLESS_MAX_MS * NSEC_PER_MSEC;
+    if(deadline) {
+        uint64_t now = clock_ns();
+        if(deadline <= now) {
+            /* Already due, let the periodic tick handle it */
+            program_periodic();
+            return;
+        }
+        if(deadline - now < delay)
+            delay = deadline - now;
+    }
+
+    for(int i = 0; i < timer_count; i++) {
+        if(timers[i].deferrable)
+            continue;
+
+        uint64_t next = timers[i].last_triggered + timers[i].period;
+        if(next <= current_timestamp) {
+            program_periodic();
+            return;
+        }
+        if((next - current_timestamp) * NSEC_PER_MSEC < delay)
+            delay = (next - current_timestamp) * NSEC_PER_MSEC;
+    }
+
+    /* Round up, waking up early would only mean another one-shot */
+    oneshot_count = (delay * INTERNAL_FREQ + NSEC_PER_SEC - 1) / NSEC_PER_SEC;
+    program_oneshot(oneshot_count);
+    tickless = true;
+}
+
+/*
+ * Go back to the periodic tick, if tickless
+ */
+void timer_tickless_exit()
+{
+    if(!tickless)
+        return;
+
+    tickless_stop();
+    program_periodic();
+}
+
 uint32_t timer_schedule(timer_callback_t callback, void* data, uint32_t period, bool recurring)
 {
     assert(timer_count < countof(timers) - 1);
 
     enter_critical_section();
 
+    /* The new timer may expire before the programmed one-shot */
+    timer_tickless_exit();
+
     uint32_t id = next_timer_id++;
     timers[timer_count].id = id;
     timers[timer_count].callback = callback;
     timers[timer_count].callback_data = data;
     timers[timer_count].period = period;
     timers[timer_count].recurring = recurring;
+    timers[timer_count].deferrable = false;
+    timers[timer_count].last_triggered = current_timestamp;
 
     timer_count++;
 
@@ -105,8 +280,8 @@ void timer_unschedule(uint32_t id)
     }
 
     if(index != -1) {
-        if(index != timer_count) {
-            timers[index] = timers[timer_count];
+        if(index != timer_count - 1) {
+            timers[index] = timers[timer_count - 1];
         }
         timer_count--;
     }
@@ -114,6 +289,24 @@ void timer_unschedule(uint32_t id)
     leave_critical_section();
 }
 
+/*
+ * Deferrable timers only matter while the system is busy,
+ * they are not taken into account when programming the one-shot
+ */
+void timer_set_deferrable(uint32_t id, bool deferrable)
+{
+    enter_critical_section();
+
+    for(int i = 0; i < timer_count; i++) {
+        if(timers[i].id == id) {
+            timers[i].deferrable = deferrable;
+            break;
+        }
+    }
+
+    leave_critical_section();
+}
+
 
 
 
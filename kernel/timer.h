@@ -12,6 +12,11 @@ uint32_t timer_schedule(timer_callback_t callback,
                         uint32_t period, 
                         bool recurring);
 void timer_unschedule(uint32_t id);
+void timer_set_deferrable(uint32_t id, bool deferrable);
 uint64_t timer_timestamp();
 uint64_t timer_ticks();
 
+void timer_tickless_enter(uint64_t deadline);
+void timer_tickless_exit();
+uint64_t timer_ticks_avoided();
+
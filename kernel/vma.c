@@ -0,0 +1,184 @@
+#include "vma.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "kmalloc.h"
+#include "string.h"
+#include "util.h"
+#include "kdebug.h"
+#include "page_cache.h"
+#include "scheduler.h"
+
+/* Pages are changed a pagetable at a time, preemptible in between */
+#define VMA_BATCH_SPAN          (1024 * PAGE_SIZE)
+
+static uint32_t batch_end(uint32_t from, uint32_t end)
+{
+    uint32_t to = TRUNCATE(from, VMA_BATCH_SPAN) + VMA_BATCH_SPAN;
+    return to < end ? to : end;
+}
+
+void vma_add(struct vma_list* vmas, uint32_t start, uint32_t end, uint32_t flags,
+             const unsigned char* data, uint32_t data_size)
+{
+    assert(IS_ALIGNED(start, PAGE_SIZE));
+    assert(IS_ALIGNED(end, PAGE_SIZE));
+    assert(start < end);
+    assert(data_size <= end - start);
+
+    struct vma* vma = kmalloc(sizeof(struct vma));
+    bzero(vma, sizeof(struct vma));
+    vma->start = start;
+    vma->end = end;
+    vma->flags = flags;
+    vma->data = data;
+    vma->data_size = data_size;
+
+    list_append(vmas, vma, node);
+}
+
+struct vma* vma_find(struct vma_list* vmas, uint32_t address)
+{
+    list_foreach(vma, vma, vmas, node) {
+        if(address >= vma->start && address < vma->end)
+            return vma;
+    }
+    return NULL;
+}
+
+void vma_clone(struct vma_list* dst, const struct vma_list* src)
+{
+    list_foreach(vma, vma, src, node) {
+        vma_add(dst, vma->start, vma->end, vma->flags, vma->data, vma->data_size);
+    }
+}
+
+bool vma_overlaps(struct vma_list* vmas, uint32_t start, uint32_t end)
+{
+    list_foreach(vma, vma, vmas, node) {
+        if(vma->start < end && vma->end > start)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Split the region holding address in two at address
+ * The second half keeps the rest of the data, if any
+ */
+static void vma_split(struct vma_list* vmas, uint32_t address)
+{
+    struct vma* vma = vma_find(vmas, address);
+    if(!vma || vma->start == address)
+        return;
+
+    uint32_t offset = address - vma->start;
+    if(vma->data_size > offset) {
+        vma_add(vmas, address, vma->end, vma->flags, vma->data + offset, vma->data_size - offset);
+        vma->data_size = offset;
+    } else {
+        vma_add(vmas, address, vma->end, vma->flags, NULL, 0);
+    }
+    vma->end = address;
+}
+
+void vma_unmap(struct vma_list* vmas, uint32_t start, uint32_t end)
+{
+    assert(IS_ALIGNED(start, PAGE_SIZE));
+    assert(IS_ALIGNED(end, PAGE_SIZE));
+
+    vma_split(vmas, start);
+    vma_split(vmas, end);
+
+    list_foreach(vma, vma, vmas, node) {
+        if(vma->start < start || vma->end > end)
+            continue;
+
+        /* Out of the list first, so its pages cannot be faulted in again meanwhile */
+        list_remove(vmas, vma, node);
+
+        for(uint32_t from = vma->start, to; from < vma->end; from = to) {
+            to = batch_end(from, vma->end);
+            vmm_unmap_range((void*)from, (to - from) / PAGE_SIZE);
+            task_preempt_point();
+        }
+        kfree(vma);
+    }
+}
+
+bool vma_protect(struct vma_list* vmas, uint32_t start, uint32_t end, uint32_t flags)
+{
+    assert(IS_ALIGNED(start, PAGE_SIZE));
+    assert(IS_ALIGNED(end, PAGE_SIZE));
+
+    /* Regions never overlap, so they cover the range if their parts in it add up */
+    uint32_t covered = 0;
+    list_foreach(vma, vma, vmas, node) {
+        uint32_t from = vma->start > start ? vma->start : start;
+        uint32_t to = vma->end < end ? vma->end : end;
+        if(from < to)
+            covered += to - from;
+    }
+    if(covered != end - start)
+        return false;
+
+    vma_split(vmas, start);
+    vma_split(vmas, end);
+
+    list_foreach(vma, vma, vmas, node) {
+        if(vma->start < start || vma->end > end)
+            continue;
+
+        /* Pages faulted in from now on get the new flags, remap the present ones */
+        vma->flags = flags;
+        for(uint32_t from = vma->start, to; from < vma->end; from = to) {
+            to = batch_end(from, vma->end);
+            vmm_protect_range((void*)from, (to - from) / PAGE_SIZE, flags & VMM_PAGE_WRITABLE);
+            task_preempt_point();
+        }
+    }
+    return true;
+}
+
+void vma_clear(struct vma_list* vmas)
+{
+    list_foreach(vma, vma, vmas, node) {
+        list_remove(vmas, vma, node);
+        kfree(vma);
+    }
+}
+
+bool vma_fault(struct vma_list* vmas, void* address)
+{
+    unsigned char* page = (unsigned char*)((uint32_t)address & ~(PAGE_SIZE - 1));
+
+    struct vma* vma = vma_find(vmas, (uint32_t)page);
+    if(!vma)
+        return false;
+
+    /* Another thread of the process faulted it in first */
+    if(vmm_get_flags(page) & VMM_PAGE_PRESENT)
+        return true;
+
+    uint32_t offset = (uint32_t)page - vma->start;
+    uint32_t copy = offset < vma->data_size ? vma->data_size - offset : 0;
+    if(copy > PAGE_SIZE)
+        copy = PAGE_SIZE;
+
+    /* Read-only image pages are shared by every process running the image */
+    if(copy && !(vma->flags & VMM_PAGE_WRITABLE)) {
+        vmm_map(page, page_cache_get(vma->data + offset, copy), vma->flags);
+        return true;
+    }
+
+    uint32_t frame = pmm_alloc();
+    assert(frame != INVALID_FRAME);
+
+    /* Filled before it is mapped, the other threads never see it half done */
+    unsigned char* va = vmm_transient_map(frame, VMM_PAGE_WRITABLE);
+    memcpy(va, vma->data + offset, copy);
+    bzero(va + copy, PAGE_SIZE - copy);
+    vmm_transient_unmap(va);
+
+    vmm_map(page, frame, vma->flags);
+    return true;
+}
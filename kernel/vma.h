@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "list.h"
+
+/*
+ * Lazily backed user memory regions
+ *
+ * Pages of a region are only allocated on their first access, by the page
+ * fault handler. The first data_size bytes come from data (e.g. an ELF
+ * image in the initrd, which stays mapped for good), the rest is zero-filled.
+ * Read-only pages backed by data come from the image page cache (page_cache.h)
+ *
+ * Every user page of a process belongs to a region: its image, its thread
+ * stacks and its anonymous mappings. Regions never overlap
+ */
+struct vma {
+    list_declare_node(vma) node;
+    uint32_t start;                 /* Page aligned */
+    uint32_t end;                   /* Page aligned, exclusive */
+    uint32_t flags;                 /* VMM_PAGE_* of its pages once populated */
+    const unsigned char* data;
+    uint32_t data_size;
+};
+list_declare(vma_list, vma);
+
+void vma_add(struct vma_list* vmas, uint32_t start, uint32_t end, uint32_t flags,
+             const unsigned char* data, uint32_t data_size);
+struct vma* vma_find(struct vma_list* vmas, uint32_t address);
+void vma_clone(struct vma_list* dst, const struct vma_list* src);
+void vma_clear(struct vma_list* vmas);
+bool vma_overlaps(struct vma_list* vmas, uint32_t start, uint32_t end);
+
+/*
+ * Change [start, end) of the current address space, splitting the regions
+ * it cuts through. Both may stop at preemption points
+ */
+void vma_unmap(struct vma_list* vmas, uint32_t start, uint32_t end);   /* Populated pages are freed */
+bool vma_protect(struct vma_list* vmas, uint32_t start, uint32_t end,  /* False if part of it is not mapped */
+                 uint32_t flags);
+
+/*
+ * Populate the page holding address, in the current address space
+ * Returns false if it is not part of a region
+ */
+bool vma_fault(struct vma_list* vmas, void* address);
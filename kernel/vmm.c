@@ -7,7 +7,8 @@
 #include "util.h"
 #include "kernel.h"
 #include "locks.h"
-#include "list.h"
+#include "scheduler.h"
+#include "smp.h"
 
 #define PTE_PRESENT             (1)
 #define PTE_WRITABLE            (1 << 1)
@@ -21,6 +22,7 @@
 #define PTE_AVL0                (1 << 9)
 #define PTE_AVL1                (1 << 10)
 #define PTE_AVL2                (1 << 11)
+#define PTE_COW                 PTE_AVL0    /* Read-only copy-on-write page, writable once copied */
 #define PTE_FRAME               0xFFFFF000
 #define PTE_OFFSET              0x00000FFF
 #define PTE_FLAGS               0x00000FFF
@@ -50,6 +52,41 @@
 #define KERNEL_PDE_END                  1022
 #define RECURSIVE_MAPPING_PDE           1023
 
+#define CPUID_EDX_PGE                   (1 << 13)
+
+/* Bytes mapped by a pagetable */
+#define PAGETABLE_SPAN                  (1024 * PAGE_SIZE)
+
+/*
+ * Temporary mappings, see vmm_transient_map()
+ * Each cpu owns KMAP_SLOTS fixed pages right below the local APIC page
+ * (see smp.c), used as a stack. The window sits in a single kernel
+ * pagetable, allocated once by vmm_init() like every other
+ */
+#define KMAP_SLOTS                      8
+#define KMAP_END                        0xFFBFF000
+#define KMAP_START                      (KMAP_END - MAX_CPUS * KMAP_SLOTS * PAGE_SIZE)
+#define KMAP_VA(slot)                   ((void*)(KMAP_START + (slot) * PAGE_SIZE))
+
+/*
+ * TLB invalidation of batched updates
+ * The current cpu invalidates changed user pages one invlpg at a time, up
+ * to this many, and reloads cr3 past it (tlb_batch_flush()). Other cpus
+ * only hold translations of the address space their current task runs in,
+ * switching pagedirs flushes the rest: when a change can leave them stale,
+ * the cpus running the current address space are sent a shootdown IPI and
+ * reload cr3, which the sender waits for (tlb_batch_shootdown()).
+ * Mapping pages that were not present needs neither, they were never cached
+ */
+#define TLB_FLUSH_PAGES_MAX             32
+
+/*
+ * Kernel pagetables are all allocated by vmm_init() and never freed:
+ * every pagedir points to the same ones, so kernel mappings are shared
+ * by construction. They are global, and survive cr3 reloads
+ */
+#define IS_KERNEL_VA(va)                ((uint32_t)(va) >= KERNEL_START)
+
 struct pagedir {
     uint32_t entries[1024];
 };
@@ -63,6 +100,10 @@ struct va_info {
     unsigned table_index;
 };
 
+struct tlb_batch {
+    unsigned pages;                 /* Changed so far */
+};
+
 struct va_info_ex {
     struct va_info info;
 
@@ -73,9 +114,16 @@ struct va_info_ex {
     uint32_t flags;
 };
 
+struct kmap_cpu {
+    unsigned depth;                 /* Slots in use */
+    if_state_t ifstate[KMAP_SLOTS]; /* To restore when each is unmapped */
+};
+
 static bool             paging_enabled = false;
 static struct pagedir*  current_pagedir = (struct pagedir*)0xFFFFF000;
 static struct pagedir*  current_pagedir_va = NULL;
+static uint32_t*        kmap_ptes = NULL;           /* PTE of every slot, indexed by slot */
+static struct kmap_cpu  kmaps[MAX_CPUS];
 
 static void vmm_map_linear(struct pagedir* pagedir, uint32_t va, uint32_t pa, uint32_t flags);
 extern void invlpg(uint32_t va);
@@ -95,6 +143,32 @@ static void flush_tlb()
     leave_critical_section();
 }
 
+static void tlb_batch_add(struct tlb_batch* batch, void* va)
+{
+    /* Global kernel pages survive cr3 reloads */
+    if(++batch->pages <= TLB_FLUSH_PAGES_MAX || IS_KERNEL_VA(va))
+        invlpg((uint32_t)va);
+}
+
+static void tlb_batch_flush(struct tlb_batch* batch)
+{
+    if(batch->pages > TLB_FLUSH_PAGES_MAX)
+        flush_tlb();
+    batch->pages = 0;
+}
+
+/*
+ * Also flush the other cpus running the current address space, whose
+ * threads could keep using the old translations. Done before the kernel
+ * lock is released, so frames freed meanwhile cannot be reused yet
+ */
+static void tlb_batch_shootdown(struct tlb_batch* batch)
+{
+    if(batch->pages)
+        task_flush_tlb_others();
+    tlb_batch_flush(batch);
+}
+
 /* 
  * TODO: Unpack parameters, some calling code dont have a va_info
  * Still require two params so we cannot possibly be confused on wether
@@ -127,6 +201,41 @@ static void va_info_ex(struct va_info_ex* result, void* va)
     }
 }
 
+/*
+ * Entry of page in the current pagedir, NULL if its pagetable is not present
+ */
+static uint32_t* get_pte(void* page)
+{
+    struct va_info info = va_info(page);
+    if(!(current_pagedir->entries[info.dir_index] & PDE_PRESENT))
+        return NULL;
+    return &get_pagetable(info)->entries[info.table_index];
+}
+
+/*
+ * Pagetable of va in the current pagedir, allocated if needed
+ * NOTE: Do not call kmalloc in this function as kmalloc might call vmm_map
+ */
+static struct pagetable* get_or_create_pagetable(void* va)
+{
+    struct va_info info = va_info(va);
+    struct pagetable* table = get_pagetable(info);
+
+    if(!(current_pagedir->entries[info.dir_index] & PDE_PRESENT)) {
+        assert(!IS_KERNEL_VA(va));
+
+        uint32_t table_pa = pmm_alloc();
+        assert(table_pa != INVALID_FRAME);
+        current_pagedir->entries[info.dir_index] = table_pa | PDE_PRESENT | PDE_USER | PDE_WRITABLE;
+
+        /* The recursive mapping of a freed pagetable may still be cached */
+        invlpg((uint32_t)table);
+        bzero(table, sizeof(struct pagetable));
+    }
+
+    return table;
+}
+
 static void* get_va(unsigned dir_index, unsigned table_index)
 {
     const unsigned bytes_per_pde = 4 * 1024 * 1024;
@@ -191,6 +300,39 @@ void vmm_init()
     write_cr0(cr0);
 
     paging_enabled = true;
+
+    /* 
+     * Remaining kernel pagetables, from the pmm: the early heap lives in
+     * the 4Mb mapped at boot and could not hold them all
+     */
+    for(unsigned i = KERNEL_PDE_START; i <= KERNEL_PDE_END; i++) {
+        if(!(current_pagedir->entries[i] & PDE_PRESENT)) {
+            uint32_t table_pa = pmm_alloc();
+            assert(table_pa != INVALID_FRAME);
+            current_pagedir->entries[i] = table_pa | PDE_PRESENT | PDE_USER | PDE_WRITABLE;
+
+            struct va_info info = {
+                .dir_index = i,
+                .table_index = 0
+            };
+            struct pagetable* table = get_pagetable(info);
+            invlpg((uint32_t)table);
+            bzero(table, sizeof(struct pagetable));
+        }
+    }
+
+    assert(PAGE_DIRECTORY_INDEX(KMAP_START) == PAGE_DIRECTORY_INDEX(KMAP_END - 1));
+    kmap_ptes = get_pte(KMAP_VA(0));
+
+    vmm_init_cpu();
+}
+
+void vmm_init_cpu()
+{
+    assert(paging_enabled);
+
+    if(cpuid_features() & CPUID_EDX_PGE)
+        write_cr4(read_cr4() | CR4_PGE);
 }
 
 /*
@@ -221,7 +363,7 @@ static void vmm_map_linear(struct pagedir* pagedir, uint32_t va, uint32_t pa, ui
         abort();
     }
 
-    table->entries[info.table_index] = (pa & PTE_FRAME) | flags;
+    table->entries[info.table_index] = (pa & PTE_FRAME) | flags | PTE_CPU_GLOBAL;
 }
 
 /*
@@ -235,51 +377,128 @@ void vmm_map(void* va, uint32_t pa, uint32_t flags)
     assert(IS_ALIGNED(va, PAGE_SIZE));
     assert(IS_ALIGNED(pa, PAGE_SIZE));
 
+    if(IS_KERNEL_VA(va))
+        flags |= PTE_CPU_GLOBAL;
+
     enter_critical_section();
 
     struct va_info info = va_info((void*)va);
+    struct pagetable* table = get_or_create_pagetable(va);
 
-    /* Check if present in page directory */
-    bool pde_present = current_pagedir->entries[info.dir_index] & PDE_PRESENT;
-    if(!pde_present) {
-        /*
-         * NOTE: Do not call kmalloc in this function as kmalloc
-         * might call vmm_map
-         *
-         * Alloc 4k frame for page table
-         */
-        uint32_t table_pa = pmm_alloc();
-        assert(table_pa != INVALID_FRAME);
+    if(table->entries[info.table_index] & PTE_PRESENT) {
+        trace("VA %p already mapped", va);
+        abort();
+    }
 
-        /* And stash into pagedir */
-        current_pagedir->entries[info.dir_index] = ((uint32_t)table_pa) | PDE_PRESENT | PDE_USER | PDE_WRITABLE;
+    table->entries[info.table_index] = (pa & PTE_FRAME) | flags;
+    vmm_flush_tlb(va);
 
-        /*
-         * Reload cr3
-         * TODO: Replace with vmm_flush_tlb()
-         */
-        flush_tlb();
+    leave_critical_section();
+}
 
-        pde_present = current_pagedir->entries[info.dir_index] & PDE_PRESENT;
-        assert(pde_present);
+unsigned vmm_map_range(void* va, unsigned count, uint32_t flags)
+{
+    assert(paging_enabled);
 
-        struct pagetable* table = get_pagetable(info);
-        bzero(table, sizeof(struct pagetable));
-        table->entries[info.table_index] = (pa & PTE_FRAME) | flags;
-    } else {
-        struct pagetable* table = get_pagetable(info);
+    assert(flags & VMM_PAGE_PRESENT);
+    assert(IS_ALIGNED(va, PAGE_SIZE));
+
+    if(IS_KERNEL_VA(va))
+        flags |= PTE_CPU_GLOBAL;
 
-        if(table->entries[info.table_index] & PTE_PRESENT) {
-            trace("VA %p already mapped", va);
+    enter_critical_section();
+
+    struct tlb_batch batch = {0};
+    unsigned mapped = 0;
+
+    for(unsigned char* page = va; mapped < count; page += PAGE_SIZE) {
+        uint32_t frame = pmm_alloc();
+        if(frame == INVALID_FRAME)
+            break;
+
+        struct pagetable* table = get_or_create_pagetable(page);
+        uint32_t* entry = &table->entries[PAGE_TABLE_INDEX((uint32_t)page)];
+        if(*entry & PTE_PRESENT) {
+            trace("VA %p already mapped", page);
             abort();
         }
 
-        table->entries[info.table_index] = (pa & PTE_FRAME) | flags;
+        *entry = frame | flags;
+        tlb_batch_add(&batch, page);
+        mapped++;
     }
 
-    /* TODO: Replace with vmm_flush_tlb */
-    flush_tlb();
+    /* Only pages that were not present */
+    tlb_batch_flush(&batch);
+    leave_critical_section();
+
+    return mapped;
+}
+
+void vmm_unmap_range(void* va, unsigned count)
+{
+    assert(paging_enabled);
+    assert(IS_ALIGNED(va, PAGE_SIZE));
+
+    enter_critical_section();
+
+    struct tlb_batch batch = {0};
+    uint32_t page = (uint32_t)va;
+    uint32_t end = page + count * PAGE_SIZE;
+
+    while(page < end) {
+        uint32_t* entry = get_pte((void*)page);
+        if(!entry) {
+            page = TRUNCATE(page, PAGETABLE_SPAN) + PAGETABLE_SPAN;
+            continue;
+        }
+
+        if(*entry & PTE_PRESENT) {
+            pmm_free(*entry & PTE_FRAME);
+            *entry = 0;
+            tlb_batch_add(&batch, (void*)page);
+        }
+        page += PAGE_SIZE;
+    }
 
+    tlb_batch_shootdown(&batch);
+    leave_critical_section();
+}
+
+void vmm_protect_range(void* va, unsigned count, bool writable)
+{
+    assert(paging_enabled);
+    assert(IS_ALIGNED(va, PAGE_SIZE));
+    assert((uint32_t)va >= USER_START && (uint32_t)va + count * PAGE_SIZE - 1 <= USER_END);
+
+    enter_critical_section();
+
+    struct tlb_batch batch = {0};
+    uint32_t page = (uint32_t)va;
+    uint32_t end = page + count * PAGE_SIZE;
+
+    while(page < end) {
+        uint32_t* entry = get_pte((void*)page);
+        if(!entry) {
+            page = TRUNCATE(page, PAGETABLE_SPAN) + PAGETABLE_SPAN;
+            continue;
+        }
+
+        if(*entry & PTE_PRESENT) {
+            uint32_t frame = *entry & PTE_FRAME;
+            uint32_t flags = *entry & PTE_FLAGS & ~(PTE_WRITABLE | PTE_COW);
+            if(writable)
+                flags |= pmm_refcount(frame) == 1 ? PTE_WRITABLE : PTE_COW;
+
+            if((frame | flags) != *entry) {
+                *entry = frame | flags;
+                tlb_batch_add(&batch, (void*)page);
+            }
+        }
+        page += PAGE_SIZE;
+    }
+
+    tlb_batch_shootdown(&batch);
     leave_critical_section();
 }
 
@@ -290,6 +509,9 @@ void vmm_remap(void* va, uint32_t flags)
     assert(IS_ALIGNED(va, PAGE_SIZE));
     assert(flags & VMM_PAGE_PRESENT);       /* Use vmm_unmap to unmap */
 
+    if(IS_KERNEL_VA(va))
+        flags |= PTE_CPU_GLOBAL;
+
     enter_critical_section();
 
     struct va_info info = va_info((void*)va);
@@ -306,7 +528,7 @@ void vmm_remap(void* va, uint32_t flags)
     uint32_t frame = table->entries[info.table_index] & PTE_FRAME;
     table->entries[info.table_index] = frame | flags;
 
-    flush_tlb();
+    vmm_flush_tlb(va);
 
     leave_critical_section();
 }
@@ -333,7 +555,7 @@ void vmm_unmap(void* va)
 
     table->entries[info.table_index] &= ~PTE_PRESENT;
 
-    flush_tlb();
+    vmm_flush_tlb(va);
 
     leave_critical_section();
 }
@@ -343,43 +565,57 @@ bool vmm_paging_enabled()
     return paging_enabled;
 }
 
-static void clone_pagetable(struct pagetable* dst, struct pagetable* src)
+/*
+ * Share the pages of src with dst
+ * Writable pages become read-only copy-on-write in both, see vmm_resolve_cow()
+ */
+static void clone_pagetable(struct pagetable* dst, struct pagetable* src, unsigned dir_index,
+                            struct tlb_batch* batch)
 {
     bzero(dst, sizeof(struct pagetable));
 
     for(unsigned i = 0; i < 1024; i++) {
         if(src->entries[i] & PTE_PRESENT) {
-            uint32_t frame = src->entries[i] & PTE_FRAME;
-            uint32_t flags = src->entries[i] & PTE_FLAGS;
-
-            uint32_t new_frame = pmm_alloc();
-            assert(new_frame != INVALID_FRAME);
-
-            /* TODO: No need map for source buf */
-            void* src_buf = vmm_transient_map(frame, VMM_PAGE_PRESENT);
-            void* dst_buf = vmm_transient_map(new_frame, VMM_PAGE_PRESENT | VMM_PAGE_WRITABLE);
-            memcpy(dst_buf, src_buf, PAGE_SIZE);
-            vmm_transient_unmap(dst_buf);
-            vmm_transient_unmap(src_buf);
+            if(src->entries[i] & PTE_WRITABLE) {
+                src->entries[i] = (src->entries[i] & ~PTE_WRITABLE) | PTE_COW;
+                tlb_batch_add(batch, get_va(dir_index, i));
+            }
 
-            dst->entries[i] = new_frame | flags;
+            pmm_ref(src->entries[i] & PTE_FRAME);
+            dst->entries[i] = src->entries[i];
         }
     }
 }
 
-struct pagedir* vmm_clone_pagedir()
+struct pagedir* vmm_create_pagedir()
 {
     struct pagedir* result = kmalloc_a(sizeof(struct pagedir), PAGE_SIZE);
     memset(result, 0, sizeof(struct pagedir));
 
     enter_critical_section();
 
+    for(int i = KERNEL_PDE_START; i <= KERNEL_PDE_END; i++) {
+        result->entries[i] = current_pagedir->entries[i];
+    }
+    result->entries[RECURSIVE_MAPPING_PDE] = ((uint32_t)vmm_get_physical(result)) | PDE_PRESENT | PDE_WRITABLE;
+
+    leave_critical_section();
+    return result;
+}
+
+struct pagedir* vmm_clone_pagedir()
+{
+    struct pagedir* result = vmm_create_pagedir();
+
     /*
      * 0     - 3Gb:         copy pagetable entries
-     * 3Gb   - end-4Mb:     copy pagedir entry
+     * 3Gb   - end-4Mb:     share the kernel pagetables
      * end-4Mb - end:       pagedir address
+     * Preemptible between pagetables
      */
     for(unsigned i = USER_PDE_START; i <= USER_PDE_END; i++) {
+        enter_critical_section();
+
         if(current_pagedir->entries[i] & PDE_PRESENT) {
             struct va_info info = {
                 .dir_index = i,
@@ -393,18 +629,70 @@ struct pagedir* vmm_clone_pagedir()
 
             struct pagetable* dst = vmm_transient_map(dst_frame, VMM_PAGE_PRESENT|VMM_PAGE_WRITABLE);
 
-            clone_pagetable(dst, src);
+            struct tlb_batch batch = {0};
+            clone_pagetable(dst, src, i, &batch);
 
             vmm_transient_unmap(dst);
 
             uint32_t flags = current_pagedir->entries[i] & PDE_FLAGS;
             result->entries[i] = dst_frame | flags;
+
+            /*
+             * Our own pages were write-protected, before anyone else can run:
+             * our other threads must not keep writing to frames now shared
+             */
+            tlb_batch_shootdown(&batch);
         }
+
+        leave_critical_section();
+        task_preempt_point();
     }
-    for(int i = KERNEL_PDE_START; i <= KERNEL_PDE_END; i++) {
-        result->entries[i] = current_pagedir->entries[i];
+
+    return result;
+}
+
+bool vmm_resolve_cow(void* va)
+{
+    if((uint32_t)va < USER_START || (uint32_t)va > USER_END)
+        return false;
+
+    enter_critical_section();
+
+    void* page = (void*)TRUNCATE((uint32_t)va, PAGE_SIZE);
+    struct va_info_ex info;
+    va_info_ex(&info, page);
+
+    /* Copied by another thread of ours, with the old translation left in our TLB */
+    if((info.flags & PTE_PRESENT) && (info.flags & PTE_WRITABLE)) {
+        vmm_flush_tlb(page);
+        leave_critical_section();
+        return true;
+    }
+
+    bool result = (info.flags & PTE_PRESENT) && (info.flags & PTE_COW);
+    if(result) {
+        uint32_t flags = (info.flags & ~PTE_COW) | PTE_WRITABLE;
+        struct pagetable* table = get_pagetable(info.info);
+
+        if(pmm_refcount(info.frame) == 1) {
+            /* Every other sharer is gone already */
+            table->entries[info.info.table_index] = info.frame | flags;
+        } else {
+            uint32_t frame = pmm_alloc();
+            assert(frame != INVALID_FRAME);
+
+            void* copy = vmm_transient_map(frame, VMM_PAGE_PRESENT | VMM_PAGE_WRITABLE);
+            memcpy(copy, page, PAGE_SIZE);
+            vmm_transient_unmap(copy);
+
+            table->entries[info.info.table_index] = frame | flags;
+            pmm_free(info.frame);
+        }
+        vmm_flush_tlb(page);
+
+        /* Our other threads must stop reading the shared frame */
+        task_flush_tlb_others();
     }
-    result->entries[RECURSIVE_MAPPING_PDE] = ((uint32_t)vmm_get_physical(result)) | PDE_PRESENT | PDE_WRITABLE;
 
     leave_critical_section();
     return result;
@@ -415,13 +703,7 @@ struct pagedir* vmm_clone_pagedir()
  */
 void vmm_reset_current_pagedir()
 {
-    /* 
-     * Care: the kernel stack for current process is in the user-part of memory 
-     * For now: we just forego resetting the last PDE and all would be well
-     * but a better solution would be to move kernel stacks in kernel
-     * memory area
-     */
-    for(unsigned i = USER_PDE_START; i < USER_PDE_END; i++) {
+    for(unsigned i = USER_PDE_START; i <= USER_PDE_END; i++) {
         if(current_pagedir->entries[i] & PDE_PRESENT) {
             uint32_t table_frame = current_pagedir->entries[i] & PDE_FRAME;
 
@@ -430,15 +712,23 @@ void vmm_reset_current_pagedir()
                 .table_index = 0
             };
 
+            struct tlb_batch batch = {0};
             struct pagetable* table = get_pagetable(info);
-            for(unsigned i = 0; i < 1024; i++) {
-                if(table->entries[i] & PTE_PRESENT) {
-                    uint32_t frame = table->entries[i] & PTE_FRAME;
+            for(unsigned j = 0; j < 1024; j++) {
+                if(table->entries[j] & PTE_PRESENT) {
+                    uint32_t frame = table->entries[j] & PTE_FRAME;
                     pmm_free(frame);
+                    tlb_batch_add(&batch, get_va(i, j));
                 }
             }
             pmm_free(table_frame);
             current_pagedir->entries[i] = 0;
+
+            /* The recursive mapping of the pagetable too. Only exec resets, single-threaded */
+            tlb_batch_add(&batch, table);
+            tlb_batch_flush(&batch);
+
+            task_preempt_point();
         }
     }
 }
@@ -495,62 +785,45 @@ uint32_t vmm_get_flags(void* va)
     return info.flags;
 }
 
-struct transient_map {
-    uint32_t frame;
-    unsigned flags;
-    void* address;
-    list_declare_node(transient_map) node;
-};
-list_declare(transient_map_list, transient_map);
-static struct transient_map_list transient_maps;
-
+/*
+ * O(1) and without locks: interrupts stay disabled while a slot is in use,
+ * so only its cpu ever touches it and it is never seen by another cpu's TLB
+ */
 void* vmm_transient_map(uint32_t frame, unsigned flags)
 {
-    void* address = kmalloc_a(PAGE_SIZE, PAGE_SIZE);
-
-    enter_critical_section();
-
-    struct transient_map* map = kmalloc(sizeof(struct transient_map));
-    bzero(map, sizeof(struct transient_map));
-    map->frame = vmm_get_physical(address);
-    map->flags = vmm_get_flags(address);
-    map->address = address;
+    assert(paging_enabled);
+    assert(IS_ALIGNED(frame, PAGE_SIZE));
 
-    vmm_unmap(address);
-    vmm_map(address, frame, VMM_PAGE_PRESENT | flags);
+    if_state_t ifstate = disable_if();
 
-    list_append(&transient_maps, map, node);
+    int cpu = cpu_id();
+    struct kmap_cpu* kmap = &kmaps[cpu];
+    assert(kmap->depth < KMAP_SLOTS);
 
-    leave_critical_section();
+    unsigned slot = cpu * KMAP_SLOTS + kmap->depth;
+    kmap->ifstate[kmap->depth++] = ifstate;
 
-    return address;
+    /* The slot was invalidated when last unmapped */
+    kmap_ptes[slot] = frame | flags | PTE_PRESENT;
+    return KMAP_VA(slot);
 }
 
 void vmm_transient_unmap(void* address)
 {
-    enter_critical_section();
+    int cpu = cpu_id();
+    struct kmap_cpu* kmap = &kmaps[cpu];
+    assert(kmap->depth > 0);
 
-    bool found = false;
-    list_foreach(transient_map, map, &transient_maps, node) {
-        if(map->address == address) {
-            vmm_unmap(address);
-            vmm_map(address, map->frame, map->flags);
-
-            list_remove(&transient_maps, map, node);
-            
-            kfree(map);
-            kfree(address);
-            found = true;
-
-            break;
-        }
-    }
-
-    if(!found) {
+    /* Unmapped in reverse order */
+    unsigned slot = cpu * KMAP_SLOTS + kmap->depth - 1;
+    if(address != KMAP_VA(slot)) {
         panic("Invalid transient map address");
     }
-    
-    leave_critical_section();
+
+    kmap_ptes[slot] = 0;
+    invlpg((uint32_t)address);
+
+    restore_if(kmap->ifstate[--kmap->depth]);
 }
 
 struct pagedir* vmm_current_pagedir()
@@ -568,8 +841,6 @@ void vmm_switch_pagedir(struct pagedir* pagedir)
 {
     assert(IS_ALIGNED(pagedir, PAGE_SIZE));
 
-    vmm_copy_kernel_mappings(pagedir);
-
     enter_critical_section();
     uint32_t pa = vmm_get_physical(pagedir);
     write_cr3(pa);
@@ -577,27 +848,6 @@ void vmm_switch_pagedir(struct pagedir* pagedir)
     leave_critical_section();
 }
 
-void vmm_copy_kernel_mappings(struct pagedir* pagedir)
-{
-    assert(IS_ALIGNED(pagedir, PAGE_SIZE));
-
-    enter_critical_section();
-    
-    /*
-     * Copy kernel mappings into new pagedir
-     */
-    for(int i = KERNEL_PDE_START; i <= KERNEL_PDE_END; i++) {
-        pagedir->entries[i] = current_pagedir->entries[i];
-    }
-
-    uint32_t pa = vmm_get_physical(pagedir);
-    assert((pagedir->entries[RECURSIVE_MAPPING_PDE] & PDE_FRAME) == pa);
-    assert(pagedir->entries[RECURSIVE_MAPPING_PDE] & PDE_PRESENT);
-    assert(pagedir->entries[RECURSIVE_MAPPING_PDE] & PDE_WRITABLE);
-
-    leave_critical_section();
-}
-
 
 
 
@@ -10,6 +10,7 @@
 #define VMM_PAGE_PRESENT        0x1
 #define VMM_PAGE_WRITABLE       0x2
 #define VMM_PAGE_USER           0x4
+#define VMM_PAGE_NOCACHE        0x10        /* Memory-mapped devices */
 
 #define KERNEL_START            0xC0000000
 #define KERNEL_END              0xFFBFFFFF
@@ -20,12 +21,27 @@
 struct pagedir;
 
 void vmm_init();
+void vmm_init_cpu();                                    /* Per-cpu paging features, on every cpu */
 void vmm_map(void* va, uint32_t pa, uint32_t flags);
 void vmm_unmap(void* va);
 void vmm_remap(void* va, uint32_t flags);
+
+/*
+ * Batched versions, over count pages from va: the pagetables are updated
+ * in one go, then the TLB is flushed. Unmapping and protecting also flush
+ * the other cpus running the current address space. Not preemptible,
+ * callers split large ranges, see vma.c
+ */
+unsigned vmm_map_range(void* va, unsigned count, uint32_t flags);   /* Fresh frames, returns how many were mapped */
+void vmm_unmap_range(void* va, unsigned count);                     /* Skips holes, frames are released */
+
+/*
+ * Make the present user pages of a range read-only or writable
+ * A frame still shared with another mapping only becomes copy-on-write
+ */
+void vmm_protect_range(void* va, unsigned count, bool writable);
 void vmm_flush_tlb(void* va);
 bool vmm_paging_enabled();
-void vmm_copy_kernel_mappings(struct pagedir* pagedir); /* copy current kernel mappings into specified pagedir */
 void vmm_switch_pagedir(struct pagedir* pagedir); /* VA, but translated internally into physical address */
 void vmm_destroy_pagedir(struct pagedir* pagedir);
 void vmm_reset_current_pagedir();                       /* Reset all user mappings of current pagetable */
@@ -34,10 +50,22 @@ void vmm_reset_current_pagedir();                       /* Reset all user mappin
 struct pagedir* vmm_current_pagedir();
 #endif
 
-struct pagedir* vmm_clone_pagedir();
+struct pagedir* vmm_create_pagedir();                  /* Only the kernel mappings */
+struct pagedir* vmm_clone_pagedir();                   /* User pages are shared copy-on-write */
+
+/*
+ * Write fault on va: give the current address space its own copy of a
+ * copy-on-write page. Returns false if va is not copy-on-write, true if
+ * it is writable already (the fault came from a stale TLB entry)
+ */
+bool vmm_resolve_cow(void* va);
 uint32_t vmm_get_physical(void* va); /* Returns 0 if va is not mapped */
 uint32_t vmm_get_flags(void* va);
 
+/*
+ * Map a frame for a short while, usable from interrupt handlers
+ * Interrupts are disabled until it is unmapped, in reverse order of mapping
+ */
 void* vmm_transient_map(uint32_t frame, unsigned flags);
 void vmm_transient_unmap(void* address);
 
@@ -0,0 +1,86 @@
+#include "workqueue.h"
+#include "scheduler.h"
+#include "kmalloc.h"
+#include "string.h"
+#include "locks.h"
+#include "registers.h"
+#include "idt.h"
+#include "sched.h"
+#include "kdebug.h"
+#include "port.h"
+
+list_declare(work_list, work);
+
+struct workqueue {
+    struct work_list pending;
+    int worker;                     /* pid of its kernel thread */
+};
+
+static struct workqueue* system_wq = NULL;
+
+void work_init(struct work* work, work_func_t func, void* data)
+{
+    bzero(work, sizeof(struct work));
+    work->func = func;
+    work->data = data;
+}
+
+bool queue_work(struct workqueue* wq, struct work* work)
+{
+    assert(!interrupts_enabled());
+
+    if(work->pending)
+        return false;
+
+    work->pending = true;
+    list_append(&wq->pending, work, node);
+
+    /* Ready or running workers find it before sleeping again */
+    task_wake(wq->worker);
+    return true;
+}
+
+bool schedule_work(struct work* work)
+{
+    return queue_work(system_wq, work);
+}
+
+static void worker_entry(void* data)
+{
+    struct workqueue* wq = data;
+
+    /* Work runs like interrupt handlers do, the lock is only left between items */
+    cli();
+    kernel_lock();
+    irq_latency_begin();
+
+    while(true) {
+        struct work* work = list_head(&wq->pending);
+        if(!work) {
+            task_block(INVALID_PORT, INVALID_PORT, SLEEP_INFINITE);
+            continue;
+        }
+
+        list_remove(&wq->pending, work, node);
+        work->pending = false;
+        work->func(work->data);
+
+        task_preempt_point();
+    }
+}
+
+struct workqueue* workqueue_create(const char* name, int priority)
+{
+    assert(!interrupts_enabled());
+
+    struct workqueue* wq = kmalloc(sizeof(struct workqueue));
+    list_init(&wq->pending);
+    wq->worker = kthread_create(name, worker_entry, wq, priority);
+    return wq;
+}
+
+void workqueue_init()
+{
+    /* Bottom halves come right after the interrupts they were deferred from */
+    system_wq = workqueue_create("events", PRIORITY_HIGHEST);
+}
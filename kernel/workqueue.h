@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include "list.h"
+
+/*
+ * Deferred work
+ *
+ * Interrupt handlers queue the heavy part of their processing as a work
+ * item. It runs later in the worker thread of its workqueue, under the
+ * kernel lock like a handler, but with interrupts and preemption allowed
+ * in between work items.
+ * A work item is queued at most once until its function starts running
+ */
+typedef void (*work_func_t)(void* data);
+
+struct work {
+    list_declare_node(work) node;
+    work_func_t func;
+    void* data;
+    bool pending;
+};
+
+struct workqueue;
+
+void work_init(struct work* work, work_func_t func, void* data);
+
+/* Returns false if work was already pending */
+bool queue_work(struct workqueue* wq, struct work* work);
+bool schedule_work(struct work* work);          /* On the system workqueue */
+
+struct workqueue* workqueue_create(const char* name, int priority);
+
+/* Once the scheduler is set up: create the system workqueue */
+void workqueue_init();
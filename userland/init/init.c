@@ -32,6 +32,197 @@ static void test_fat_read()
     }
 }
 
+static void test_tickless()
+{
+    uint64_t before = ticks_avoided();
+    uint64_t start = clock_ns();
+    sleep(1000);
+    uint64_t elapsed = clock_ns() - start;
+    trace("Slept 1s in %d us, timer ticks avoided: %d",
+          (uint32_t)(elapsed / 1000),
+          (uint32_t)(ticks_avoided() - before));
+}
+
+/*
+ * Two tasks running with different x87 rounding modes, each must
+ * get its own control word back after every switch
+ */
+static void test_fpu()
+{
+    int pid = fork();
+    uint16_t cw = pid ? 0x037F : 0x0F7F;      /* Round to nearest, or toward zero */
+    asm volatile ( "fldcw %0" :: "m"(cw) );
+
+    for(int i = 0; i < 100; i++) {
+        yield();
+
+        uint16_t current;
+        asm volatile ( "fnstcw %0" : "=m"(current) );
+        assert(current == cw);
+    }
+
+    if(!pid)
+        exit();
+
+    trace("FPU state preserved across task switches");
+}
+
+/*
+ * fork() shares memory copy-on-write: each side must only see its own writes,
+ * and forking should not cost more with a larger heap
+ */
+static void test_cow()
+{
+    const size_t size = 64 * 1024;
+    unsigned char* buffer = malloc(size);
+    memset(buffer, 0xAA, size);
+
+    uint64_t start = clock_ns();
+    int pid = fork();
+    uint64_t elapsed = clock_ns() - start;
+
+    unsigned char value = pid ? 0xAA : 0x55;
+    if(!pid)
+        memset(buffer, value, size);
+
+    for(int i = 0; i < 10; i++)
+        yield();
+
+    for(size_t i = 0; i < size; i++)
+        assert(buffer[i] == value);
+
+    if(!pid)
+        exit();
+
+    free(buffer);
+    trace("Copy-on-write fork in %d us", (uint32_t)(elapsed / 1000));
+}
+
+/*
+ * Anonymous memory is only populated where touched, and can be split,
+ * reprotected and given back page by page. free() trims the heap
+ */
+static void test_mmap()
+{
+    const size_t size = 64 * 1024 * 1024;
+    unsigned char* region = (unsigned char*)0x40000000;
+
+    uint64_t start = clock_ns();
+    assert(mmap(region, size, PROT_READ|PROT_WRITE) == region);
+    uint64_t elapsed = clock_ns() - start;
+
+    for(size_t offset = 0; offset < size; offset += size / 16) {
+        assert(region[offset] == 0);
+        region[offset] = 0x55;
+    }
+
+    assert(mmap(region + size / 2, 4096, PROT_READ) == NULL);
+    assert(mprotect(region, 4096, PROT_READ) == 0);
+    assert(region[0] == 0x55);
+    assert(mprotect(region, 4096, PROT_READ|PROT_WRITE) == 0);
+    region[0] = 0xAA;
+
+    assert(munmap(region + size / 2, 4096) == 0);
+    assert(mprotect(region + size / 2, 8192, PROT_READ) == -1);
+    assert(mmap(region + size / 2, 4096, PROT_READ|PROT_WRITE) == region + size / 2);
+    assert(region[size / 2] == 0);
+    assert(munmap(region, size) == 0);
+
+    unsigned char* heap_end = sbrk(0);
+    void* buffer = malloc(size / 8);
+    assert(buffer && (unsigned char*)sbrk(0) > heap_end);
+    free(buffer);
+    assert((unsigned char*)sbrk(0) < heap_end + size / 8);
+
+    trace("mmap of %d MB in %d us", size / (1024 * 1024), (uint32_t)(elapsed / 1000));
+}
+
+/*
+ * Threads of a process share its memory, the last one to finish wakes
+ * the main thread through a futex
+ */
+struct thread_test {
+    volatile int counter;
+    volatile int running;           /* Threads not done yet, futex */
+};
+
+static void thread_test_entry(void* data)
+{
+    struct thread_test* test = data;
+
+    for(int i = 0; i < 1000; i++) {
+        __sync_fetch_and_add(&test->counter, 1);
+        if(!(i % 100))
+            yield();
+    }
+
+    if(__sync_sub_and_fetch(&test->running, 1) == 0)
+        futex_wake(&test->running, 1);
+}
+
+static void test_threads()
+{
+    const int count = 4;
+    struct thread_test test = {0, count};
+
+    for(int i = 0; i < count; i++)
+        assert(thread_create(thread_test_entry, &test) != -1);
+
+    int running;
+    while((running = test.running))
+        futex_wait(&test.running, running, FUTEX_WAIT_FOREVER);
+
+    assert(test.counter == count * 1000);
+    assert(futex_wait(&test.running, 1, 1000) == FUTEX_AGAIN);
+    assert(futex_wait(&test.running, 0, 1000) == FUTEX_TIMEDOUT);
+    trace("%d threads done", count);
+}
+
+/*
+ * Time yield() ping-pongs between two tasks, first with the default
+ * port permissions, then with each task holding its own open port
+ */
+static void bench_context_switch(bool open_port)
+{
+    const int iterations = 10000;
+
+    int pid = fork();
+    if(open_port)
+        hwportopen(pid ? 0x80 : 0x81);
+
+    uint64_t start = clock_ns();
+    for(int i = 0; i < iterations; i++)
+        yield();
+    uint64_t elapsed = clock_ns() - start;
+
+    if(!pid)
+        exit();
+
+    trace("Context switch (%s iomap): %d ns per yield, %d switches/s",
+          open_port ? "custom" : "default",
+          (uint32_t)(elapsed / iterations),
+          (uint32_t)(iterations * 1000000000ULL / elapsed));
+}
+
+static void report_irq_latency()
+{
+    trace("Worst interrupt latency: %d us", (uint32_t)(irq_latency() / 1000));
+}
+
+static void report_lock_stats()
+{
+    struct lock_info info;
+    for(int i = 0; get_lock_stats(i, &info); i++) {
+        trace("Lock %s: %u acquisitions, %u contended, waited %d us, held %d us (max %d us)",
+              info.name,
+              info.acquisitions,
+              info.contended,
+              (uint32_t)(info.wait_ns / 1000),
+              (uint32_t)(info.hold_ns / 1000),
+              (uint32_t)(info.max_hold_ns / 1000));
+    }
+}
+
 static void test_log()
 {
     trace("It works!!!");
@@ -42,34 +233,51 @@ static void run_tests()
 {
 #if 1
     test_fat_read();
+    test_tickless();
+    test_fpu();
+    test_cow();
+    test_threads();
+    test_mmap();
+    bench_context_switch(false);
+    bench_context_switch(true);
+    report_irq_latency();
+    report_lock_stats();
 #else
     test_log();
 #endif
 }
 
+static int start(const char* filename)
+{
+    int pid = spawn(filename, NULL);
+    if(pid < 0)
+        panic("Failed to start %s", filename);
+    return pid;
+}
+
 void main()
 {
     /* Start logger */
-    int logger_pid = fork();
-    if(!logger_pid) {
-        exec("logger.elf");
-        invalid_code_path();
-    }
+    int logger_pid = start("logger.elf");
+    setpriority(logger_pid, PRIORITY_SERVER);
 
 #if 1
     /* Start block driver */
-    int blockdrv_pid = fork();
-    if(!blockdrv_pid) {
-        exec("blk.elf");
-        invalid_code_path();
-    }
+    int blockdrv_pid = start("blk.elf");
+    setpriority(blockdrv_pid, PRIORITY_SERVER);
+
+    /* Bounded response time for the driver: 2 ms every 10 ms */
+    if(setsched_rt(blockdrv_pid, 10000, 2000, 0))
+        trace("blk.elf was not admitted as a real-time task");
 
     /* Start vfs */
-    int vfs_pid = fork();
-    if(!vfs_pid) {
-        exec("vfs.elf");
-        invalid_code_path();
-    }
+    int vfs_pid = start("vfs.elf");
+    setpriority(vfs_pid, PRIORITY_SERVER);
+#endif
+
+#if 0
+    /* Start top */
+    start("top.elf");
 #endif
 
     /* Run tests */
@@ -4,6 +4,7 @@ extern runtime_entry
 
 global _entry
 _entry:
+    push    ebx             ; argument string, see spawn()
     call    runtime_entry
     mov     eax, 0          ; SYSCALL_EXIT
     int     0x80
@@ -0,0 +1,23 @@
+#include <stddef.h>
+#include <port.h>
+#include <debug.h>
+#include "runtime.h"
+#include "kernel_task_client.h"
+
+bool get_lock_stats(int index, struct lock_info* buffer)
+{
+    size_t buffer_size = sizeof(*buffer);
+    int ret;
+    int rpc_ret = kernel_get_lock_stats(&ret,
+                                        KernelPort,
+                                        pcb.ack_port,
+                                        index,
+                                        buffer,
+                                        &buffer_size);
+    handle_rpc_ret(rpc_ret);
+    if(ret)
+        return false;
+    else if(buffer_size < sizeof(*buffer))
+        return false;
+    return true;
+}
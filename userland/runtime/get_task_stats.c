@@ -0,0 +1,23 @@
+#include <stddef.h>
+#include <port.h>
+#include <debug.h>
+#include "runtime.h"
+#include "kernel_task_client.h"
+
+bool get_task_stats(int pid, struct task_stats* buffer)
+{
+    size_t buffer_size = sizeof(*buffer);
+    int ret;
+    int rpc_ret = kernel_get_task_stats(&ret,
+                                        KernelPort,
+                                        pcb.ack_port,
+                                        pid,
+                                        buffer,
+                                        &buffer_size);
+    handle_rpc_ret(rpc_ret);
+    if(ret)
+        return false;
+    else if(buffer_size < sizeof(*buffer))
+        return false;
+    return true;
+}
@@ -0,0 +1,15 @@
+#include <stddef.h>
+#include <port.h>
+#include <debug.h>
+#include "runtime.h"
+#include "kernel_task_client.h"
+
+uint64_t irq_latency()
+{
+    long long ret;
+    int rpc_ret = kernel_get_irq_latency(&ret,
+                                         KernelPort,
+                                         pcb.ack_port);
+    handle_rpc_ret(rpc_ret);
+    return ret;
+}
@@ -13,9 +13,17 @@
 #include "malloc.h"
 #include "util.h"
 
-struct pcb pcb;
+/* Indexed by the user stack slot of the thread, see thread.h */
+static struct control_block pcbs[MAX_THREADS];
 int errno = 0;
 
+struct control_block* current_pcb()
+{
+    uint32_t esp;
+    asm volatile ( "mov %%esp, %0" : "=r"(esp) );
+    return &pcbs[THREAD_SLOT(esp)];
+}
+
 void yield()
 {
     syscall(SYSCALL_YIELD, 0, 0, 0, 0, 0);
@@ -30,16 +38,40 @@ int fork()
     return pid;
 }
 
-void sleep(unsigned ms)
+void usleep(unsigned us)
 {
     syscall(SYSCALL_SLEEP,
-            ms,
+            us,
             0,
             0,
             0,
             0);
 }
 
+void sleep(unsigned ms)
+{
+    /* Sleep in chunks, so that the microsecond count does not overflow */
+    const unsigned max_ms = 1000000;
+    while(ms > max_ms) {
+        usleep(max_ms * 1000);
+        ms -= max_ms;
+    }
+    usleep(ms * 1000);
+}
+
+uint64_t clock_ns()
+{
+    uint64_t ns;
+    int ret = syscall(SYSCALL_CLOCK,
+                      (uint32_t)&ns,
+                      0,
+                      0,
+                      0,
+                      0);
+    assert(ret == 0);
+    return ns;
+}
+
 void exit()
 {
     syscall(SYSCALL_EXIT,
@@ -66,6 +98,69 @@ void exec(const char* filename)
     panic("Exec failed");
 }
 
+int spawn(const char* filename, const char* args)
+{
+    int ret = syscall(SYSCALL_SPAWN,
+                      (uint32_t)filename,
+                      (uint32_t)args,
+                      0,
+                      0,
+                      0);
+    return ret;
+}
+
+/* First frame of every thread but the main one, see thread_create() */
+static void thread_start(void (*entry)(void*), void* arg)
+{
+    pcb.ack_port = port_open(-1);
+    pcb.args = "";
+    entry(arg);
+    thread_exit();
+}
+
+int thread_create(void (*entry)(void*), void* arg)
+{
+    int ret = syscall(SYSCALL_THREAD_CREATE,
+                      (uint32_t)thread_start,
+                      (uint32_t)entry,
+                      (uint32_t)arg,
+                      0,
+                      0);
+    return ret;
+}
+
+void thread_exit()
+{
+    syscall(SYSCALL_THREAD_EXIT,
+            0,
+            0,
+            0,
+            0,
+            0);
+}
+
+int futex_wait(volatile int* addr, int expected, unsigned timeout_us)
+{
+    int ret = syscall(SYSCALL_FUTEX_WAIT,
+                      (uint32_t)addr,
+                      expected,
+                      timeout_us,
+                      0,
+                      0);
+    return ret;
+}
+
+int futex_wake(volatile int* addr, int count)
+{
+    int ret = syscall(SYSCALL_FUTEX_WAKE,
+                      (uint32_t)addr,
+                      count,
+                      0,
+                      0,
+                      0);
+    return ret;
+}
+
 void debug_writen(const char* str, size_t count)
 {
     while(count) {
@@ -100,12 +195,23 @@ void* mmap(void* addr, size_t size, uint32_t flags)
     return (void*)result;
 }
 
-int munmap(void* addr)
+int munmap(void* addr, size_t size)
 {
     uint32_t result = syscall(SYSCALL_MUNMAP,
                               (uint32_t)addr,
+                              (uint32_t)size,
                               0,
                               0,
+                              0);
+    return (int)result;
+}
+
+int mprotect(void* addr, size_t size, uint32_t flags)
+{
+    uint32_t result = syscall(SYSCALL_MPROTECT,
+                              (uint32_t)addr,
+                              (uint32_t)size,
+                              flags,
                               0,
                               0);
     return (int)result;
@@ -120,7 +226,18 @@ void* sbrk(ptrdiff_t incr)
     if(!incr) {
         return program_break;
     } else if(incr < 0) {
-        panic("Not implemented yet");
+        /* Give the pages past the new break back */
+        unsigned char* old_break = program_break;
+        unsigned char* new_break = ALIGN(program_break + incr, 4096);
+        assert(new_break >= ALIGN(_END_, 4096));
+
+        if(new_break < old_break) {
+            int result = munmap(new_break, old_break - new_break);
+            assert(result == 0);
+        }
+
+        program_break = new_break;
+        return old_break;
     } else {
         incr = ALIGN(incr, 4096);
         void* result = mmap(program_break, incr, PROT_READ|PROT_WRITE);
@@ -131,6 +248,28 @@ void* sbrk(ptrdiff_t incr)
     }
 }
 
+int setpriority(int pid, int priority)
+{
+    int ret = syscall(SYSCALL_SETPRIORITY,
+                      pid,
+                      priority,
+                      0,
+                      0,
+                      0);
+    return ret;
+}
+
+int setsched_rt(int pid, unsigned period_us, unsigned budget_us, unsigned deadline_us)
+{
+    int ret = syscall(SYSCALL_SETSCHED,
+                      pid,
+                      period_us,
+                      budget_us,
+                      deadline_us,
+                      0);
+    return ret;
+}
+
 int hwportopen(int port)
 {
     int ret = syscall(SYSCALL_HWPORTOPEN,
@@ -143,9 +282,10 @@ int hwportopen(int port)
 }
 
 void main();
-void runtime_entry()
+void runtime_entry(const char* args)
 {
     pcb.ack_port = port_open(-1);
+    pcb.args = args ? args : "";
     main();
     exit();
 }
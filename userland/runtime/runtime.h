@@ -4,6 +4,8 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include "task_info.h"
+#include "sched.h"
+#include "thread.h"
 
 extern unsigned char __START__[];
 extern unsigned char __END__[];
@@ -11,30 +13,77 @@ extern unsigned char __END__[];
 #define _START_ ((unsigned char*)__START__)
 #define _END_ ((unsigned char*)__END__)
 
-/* Program control block */
-struct pcb {
+/* Program control block, one per thread */
+struct control_block {
     int ack_port;
+    const char* args;           /* Given to spawn(), empty if none */
 };
-extern struct pcb pcb;
+struct control_block* current_pcb();
+#define pcb (*current_pcb())
 
 void debug_write(const char* str);
 void debug_writen(const char* str, size_t count);
 void yield();
 int fork();
 void sleep(unsigned ms);
+void usleep(unsigned us);
+uint64_t clock_ns();            /* Monotonic time in nanoseconds */
 void exit();
 void reboot();
 void send_ack(int port, unsigned code, uint32_t result);
 void exec(const char* filename);
 
+/*
+ * Start filename from the initrd as a new process, without copying this one
+ * args (can be NULL) is found in the pcb of the new process
+ * Returns its pid, or -1
+ */
+int spawn(const char* filename, const char* args);
+int setpriority(int pid, int priority);
+
+/*
+ * Start a thread running entry(arg) in this process, on its own stack
+ * Returning from entry() ends the thread
+ * Returns its pid, or -1
+ */
+int thread_create(void (*entry)(void*), void* arg);
+void thread_exit();
+
+/*
+ * Sleep while *addr == expected, until futex_wake() on addr or timeout_us
+ * (FUTEX_WAIT_FOREVER for none) elapsed
+ * Returns FUTEX_WOKEN, FUTEX_AGAIN or FUTEX_TIMEDOUT
+ */
+int futex_wait(volatile int* addr, int expected, unsigned timeout_us);
+int futex_wake(volatile int* addr, int count);     /* Returns the number of threads woken */
+
+/*
+ * Real-time class: every period, pid may run for budget before its deadline
+ * (0: the period), ahead of every normal task. budget 0 goes back to the normal class
+ * Returns -2 if admission control rejected it
+ */
+int setsched_rt(int pid, unsigned period_us, unsigned budget_us, unsigned deadline_us);
+
 struct task_info;
 bool get_task_info(int pid, struct task_info* buffer);
 
+/* Stats of the live task with the lowest pid >= pid, false if there is none */
+struct task_stats;
+bool get_task_stats(int pid, struct task_stats* buffer);
+
+/* Stats of the index-th tracked kernel lock, false past the last one */
+struct lock_info;
+bool get_lock_stats(int index, struct lock_info* buffer);
+uint64_t ticks_avoided();
+uint64_t irq_latency();         /* Longest ns a cpu ran kernel code with interrupts disabled */
+
 #define     PROT_NONE           0x0
 #define     PROT_READ           0x1
 #define     PROT_WRITE          0x2
 #define     PROT_EXEC           0x4
-void* mmap(void* addr, size_t size, uint32_t flags);
+void* mmap(void* addr, size_t size, uint32_t flags);       /* Zero-filled on first access */
+int munmap(void* addr, size_t size);
+int mprotect(void* addr, size_t size, uint32_t flags);
 
 #define     O_RDONLY        0x1
 #define     O_WRONLY        0x2
@@ -0,0 +1,15 @@
+#include <stddef.h>
+#include <port.h>
+#include <debug.h>
+#include "runtime.h"
+#include "kernel_task_client.h"
+
+uint64_t ticks_avoided()
+{
+    long long ret;
+    int rpc_ret = kernel_get_ticks_avoided(&ret,
+                                           KernelPort,
+                                           pcb.ack_port);
+    handle_rpc_ret(rpc_ret);
+    return ret;
+}
@@ -0,0 +1,93 @@
+#include <runtime.h>
+#include <debug.h>
+#include <string.h>
+
+/*
+ * Periodically logs what every task did since the previous sample:
+ * share of the interval spent running, time waiting for a cpu, time
+ * blocked on IPC or sleeping, context switches and wakeups
+ */
+#define TOP_INTERVAL_MS     2000
+#define TOP_MAX_TASKS       64
+
+struct sample {
+    unsigned count;
+    struct task_stats tasks[TOP_MAX_TASKS];
+};
+
+static struct sample samples[2];
+
+static void take_sample(struct sample* sample)
+{
+    sample->count = 0;
+
+    int pid = 0;
+    while(sample->count < TOP_MAX_TASKS &&
+          get_task_stats(pid, &sample->tasks[sample->count])) {
+        pid = sample->tasks[sample->count].pid + 1;
+        sample->count++;
+    }
+}
+
+static const struct task_stats* find_task(const struct sample* sample, int pid)
+{
+    for(unsigned i = 0; i < sample->count; i++) {
+        if(sample->tasks[i].pid == pid)
+            return &sample->tasks[i];
+    }
+    return NULL;
+}
+
+static uint32_t ms(uint64_t ns)
+{
+    return (uint32_t)(ns / 1000000);
+}
+
+static void report(const struct sample* prev, const struct sample* cur)
+{
+    trace("%d tasks", cur->count);
+
+    for(unsigned i = 0; i < cur->count; i++) {
+        const struct task_stats* now = &cur->tasks[i];
+
+        /* Tasks started during the interval are compared against nothing */
+        struct task_stats zero;
+        const struct task_stats* then = find_task(prev, now->pid);
+        if(!then) {
+            bzero(&zero, sizeof(zero));
+            zero.timestamp = now->timestamp - TOP_INTERVAL_MS * 1000000ULL;
+            then = &zero;
+        }
+
+        uint64_t interval = now->timestamp - then->timestamp;
+        uint64_t run = now->sched.run_ns - then->sched.run_ns;
+        uint32_t permille = interval ? (uint32_t)((run * 1000) / interval) : 0;
+
+        trace("%d %s: cpu %d, run %d.%d%%, ready %d ms, blocked %d ms, sleep %d ms, "
+              "switches %d/%d, wakeups %d",
+              now->pid,
+              now->name,
+              now->cpu,
+              permille / 10, permille % 10,
+              ms(now->sched.ready_ns - then->sched.ready_ns),
+              ms(now->sched.blocked_ns - then->sched.blocked_ns),
+              ms(now->sched.sleep_ns - then->sched.sleep_ns),
+              now->sched.voluntary_switches - then->sched.voluntary_switches,
+              now->sched.involuntary_switches - then->sched.involuntary_switches,
+              now->sched.wakeups - then->sched.wakeups);
+    }
+}
+
+void main()
+{
+    unsigned cur = 0;
+    take_sample(&samples[cur]);
+
+    while(true) {
+        sleep(TOP_INTERVAL_MS);
+
+        cur = !cur;
+        take_sample(&samples[cur]);
+        report(&samples[!cur], &samples[cur]);
+    }
+}